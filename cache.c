@@ -0,0 +1,455 @@
+/*
+   rblpolicyd - a policy daemon for Postfix (http://www.postfix.org/),
+   which allows combining different RBLs with weights.
+
+   $Id$
+   DNS answer cache, keyed by (client address, zone index), and
+   verdict cache, keyed by client address
+
+   Copyright (C) 2004 Thomas Lamy
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+
+#include <stdio.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <time.h>
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <pthread.h>
+
+#include "system.h"
+
+#include "cfgfile.h"
+#include "cache.h"
+#include "stats.h"
+#include "globals.h"
+
+/*
+ * The table is set-associative: a key hashes to one bucket of CACHE_WAYS
+ * entries, and a bucket fills exactly one cache line. Buckets are guarded
+ * by a striped set of spinlocks.
+ *
+ * Eviction is a per-bucket CLOCK: new entries start with their reference
+ * bit clear and only get it set on a hit. A victim is picked among the
+ * unreferenced entries; only if all of them have been referenced are the
+ * bits cleared (second chance). A scan of one-time addresses therefore
+ * only ever replaces other one-time addresses.
+ */
+
+#define CACHE_WAYS     4
+#define CACHE_LOCKS    1024
+
+typedef struct {
+    unsigned int ip;
+    unsigned int addr;     /* A record, network byte order */
+    unsigned int expires;  /* cache_now() based, 0 = empty slot */
+    unsigned short zone;
+    unsigned char listed;
+    unsigned char ref;     /* CLOCK reference bit */
+} centry_t;
+
+typedef struct {
+    centry_t e[CACHE_WAYS];
+} __attribute__((aligned(64))) cbucket_t;
+
+static cbucket_t *cache = NULL;
+static unsigned int cache_mask = 0;
+static pthread_spinlock_t cache_locks[CACHE_LOCKS];
+static struct timespec cache_epoch;
+
+
+/*
+ * Seconds since the cache was set up, starting at 1
+ */
+unsigned int cache_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned int) (ts.tv_sec - cache_epoch.tv_sec) + 1;
+}
+
+
+static unsigned int cache_hash(unsigned int ip, int zone) {
+    unsigned int h = ip * 0x9e3779b1U ^ (unsigned int) zone * 0x85ebca77U;
+
+    h ^= h >> 15;
+    h *= 0x2c1b3c6dU;
+    h ^= h >> 12;
+    return h;
+}
+
+
+/*
+ * Allocate a cache of about kbytes KB (0 disables caching).
+ * Must be called before vcache_init().
+ */
+int cache_init(unsigned int kbytes) {
+    unsigned long nbuckets = 1;
+    unsigned long want;
+    void *mem;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &cache_epoch);
+    /* the locks are shared with the verdict cache */
+    for (i = 0; i < CACHE_LOCKS; i++) {
+        pthread_spin_init(&cache_locks[i], PTHREAD_PROCESS_PRIVATE);
+    }
+    if (kbytes == 0) {
+        return 0;
+    }
+    want = (unsigned long) kbytes * 1024 / sizeof(cbucket_t);
+    while (nbuckets * 2 <= want) {
+        nbuckets <<= 1;
+    }
+    if (posix_memalign(&mem, 64, nbuckets * sizeof(cbucket_t)) != 0) {
+        syslog(LOG_ERR, "Could not allocate %lu bytes for the DNS cache", nbuckets * sizeof(cbucket_t));
+        return -1;
+    }
+    memset(mem, 0, nbuckets * sizeof(cbucket_t));
+    cache = mem;
+    cache_mask = nbuckets - 1;
+    dbg("DNS cache: %lu entries in %lu KB", nbuckets * CACHE_WAYS, nbuckets * sizeof(cbucket_t) / 1024);
+    return 0;
+}
+
+
+/*
+ * Release the cache; the verdict cache must already be gone
+ */
+void cache_free(void) {
+    int i;
+
+    for (i = 0; i < CACHE_LOCKS; i++) {
+        pthread_spin_destroy(&cache_locks[i]);
+    }
+    free(cache);
+    cache = NULL;
+}
+
+
+/*
+ * Look up the answer for ip in zone. Returns 1 on a hit.
+ */
+int cache_get(unsigned int ip, int zone, cacheres_t *res) {
+    unsigned int b, now;
+    pthread_spinlock_t *lock;
+    centry_t *e;
+    int i, hit = 0;
+
+    if (!cache) {
+        return 0;
+    }
+    now = cache_now();
+    b = cache_hash(ip, zone) & cache_mask;
+    lock = &cache_locks[b % CACHE_LOCKS];
+    pthread_spin_lock(lock);
+    for (i = 0, e = cache[b].e; i < CACHE_WAYS; i++, e++) {
+        if (e->expires && e->ip == ip && e->zone == zone) {
+            if (e->expires > now) {
+                e->ref = 1;
+                res->listed = e->listed;
+                res->addr = e->addr;
+                res->ttl = e->expires - now;
+                hit = 1;
+            } else {
+                e->expires = 0;
+            }
+            break;
+        }
+    }
+    pthread_spin_unlock(lock);
+    if (hit) {
+        stats_cache_hit();
+    } else {
+        stats_cache_miss();
+    }
+    return hit;
+}
+
+
+/*
+ * Store an answer. Listed ones are kept for at most posttl seconds, the
+ * others for at most negttl; answers with a TTL of 0 are not cached.
+ */
+void cache_put(unsigned int ip, int zone, int listed, unsigned int addr, unsigned int ttl) {
+    unsigned int b, now;
+    pthread_spinlock_t *lock;
+    centry_t *e, *victim = NULL;
+    int i, evicted = 0;
+
+    if (!cache) {
+        return;
+    }
+    if (ttl > (unsigned int) (listed ? posttl : negttl)) {
+        ttl = listed ? posttl : negttl;
+    }
+    if (ttl == 0) {
+        return;
+    }
+    now = cache_now();
+    b = cache_hash(ip, zone) & cache_mask;
+    lock = &cache_locks[b % CACHE_LOCKS];
+    pthread_spin_lock(lock);
+    for (i = 0, e = cache[b].e; i < CACHE_WAYS; i++, e++) {
+        if (e->expires && e->ip == ip && e->zone == zone) {
+            /* refresh, keeping the reference bit */
+            victim = e;
+            break;
+        }
+        if (!victim && e->expires <= now) {
+            victim = e;    /* empty or expired */
+        }
+    }
+    if (!victim) {
+        /* CLOCK: oldest unreferenced entry, or clear all bits and retry */
+        for (i = 0, e = cache[b].e; i < CACHE_WAYS; i++, e++) {
+            if (!e->ref && (!victim || e->expires < victim->expires)) {
+                victim = e;
+            }
+        }
+        if (!victim) {
+            for (i = 0, e = cache[b].e; i < CACHE_WAYS; i++, e++) {
+                e->ref = 0;
+                if (!victim || e->expires < victim->expires) {
+                    victim = e;
+                }
+            }
+        }
+        victim->ref = 0;
+        evicted = 1;
+    } else if (victim->ip != ip || victim->zone != zone || !victim->expires) {
+        victim->ref = 0;
+    }
+    victim->ip = ip;
+    victim->zone = zone;
+    victim->listed = listed ? 1 : 0;
+    victim->addr = addr;
+    victim->expires = now + ttl;
+    pthread_spin_unlock(lock);
+    if (evicted) {
+        stats_cache_evict();
+    }
+}
+
+
+/*
+ * Drop all entries, e.g. after zone indices have changed
+ */
+void cache_flush(void) {
+    unsigned int b;
+
+    if (!cache) {
+        return;
+    }
+    for (b = 0; b <= cache_mask; b++) {
+        pthread_spin_lock(&cache_locks[b % CACHE_LOCKS]);
+        memset(&cache[b], 0, sizeof(cbucket_t));
+        pthread_spin_unlock(&cache_locks[b % CACHE_LOCKS]);
+    }
+}
+
+
+/*
+ * Drop the entries of one zone, which has been removed from the config
+ */
+void cache_drop_zone(int zone) {
+    unsigned int b;
+    int i;
+
+    if (!cache) {
+        return;
+    }
+    for (b = 0; b <= cache_mask; b++) {
+        pthread_spin_lock(&cache_locks[b % CACHE_LOCKS]);
+        for (i = 0; i < CACHE_WAYS; i++) {
+            if (cache[b].e[i].zone == zone) {
+                memset(&cache[b].e[i], 0, sizeof(centry_t));
+            }
+        }
+        pthread_spin_unlock(&cache_locks[b % CACHE_LOCKS]);
+    }
+}
+
+
+/*
+ * Verdict cache: the combined result for a client address, stored as a
+ * bitmask of the zones that list it. Same layout and eviction as above,
+ * with the reference bit folded into the expiry field.
+ */
+
+typedef struct {
+    unsigned int ip;
+    unsigned int expires:31;   /* cache_now() based, 0 = empty slot */
+    unsigned int ref:1;
+    unsigned long long listed;
+} ventry_t;
+
+typedef struct {
+    ventry_t e[CACHE_WAYS];
+} __attribute__((aligned(64))) vbucket_t;
+
+static vbucket_t *vcache = NULL;
+static unsigned int vcache_mask = 0;
+
+
+int vcache_init(unsigned int kbytes) {
+    unsigned long nbuckets = 1;
+    unsigned long want;
+    void *mem;
+
+    if (kbytes == 0) {
+        return 0;
+    }
+    want = (unsigned long) kbytes * 1024 / sizeof(vbucket_t);
+    while (nbuckets * 2 <= want) {
+        nbuckets <<= 1;
+    }
+    if (posix_memalign(&mem, 64, nbuckets * sizeof(vbucket_t)) != 0) {
+        syslog(LOG_ERR, "Could not allocate %lu bytes for the verdict cache", nbuckets * sizeof(vbucket_t));
+        return -1;
+    }
+    memset(mem, 0, nbuckets * sizeof(vbucket_t));
+    vcache = mem;
+    vcache_mask = nbuckets - 1;
+    dbg("Verdict cache: %lu entries in %lu KB", nbuckets * CACHE_WAYS, nbuckets * sizeof(vbucket_t) / 1024);
+    return 0;
+}
+
+
+void vcache_free(void) {
+    free(vcache);
+    vcache = NULL;
+}
+
+
+/*
+ * Look up the verdict for ip. Returns 1 on a hit, with the listing zones
+ * in *listed and the seconds left in *ttl.
+ */
+int vcache_get(unsigned int ip, unsigned long long *listed, unsigned int *ttl) {
+    unsigned int b, now;
+    pthread_spinlock_t *lock;
+    ventry_t *e;
+    int i, hit = 0;
+
+    if (!vcache) {
+        return 0;
+    }
+    now = cache_now();
+    b = cache_hash(ip, -1) & vcache_mask;
+    lock = &cache_locks[b % CACHE_LOCKS];
+    pthread_spin_lock(lock);
+    for (i = 0, e = vcache[b].e; i < CACHE_WAYS; i++, e++) {
+        if (e->expires && e->ip == ip) {
+            if (e->expires > now) {
+                e->ref = 1;
+                *listed = e->listed;
+                *ttl = e->expires - now;
+                hit = 1;
+            } else {
+                e->expires = 0;
+            }
+            break;
+        }
+    }
+    pthread_spin_unlock(lock);
+    if (hit) {
+        stats_verdict_hit();
+    } else {
+        stats_verdict_miss();
+    }
+    return hit;
+}
+
+
+/*
+ * Store the verdict for ip for ttl seconds
+ */
+void vcache_put(unsigned int ip, unsigned long long listed, unsigned int ttl) {
+    unsigned int b, now;
+    pthread_spinlock_t *lock;
+    ventry_t *e, *victim = NULL;
+    int i;
+
+    if (!vcache || ttl == 0) {
+        return;
+    }
+    /* expires has 31 bits */
+    if (ttl > CACHE_TTL_MAX) {
+        ttl = CACHE_TTL_MAX;
+    }
+    now = cache_now();
+    b = cache_hash(ip, -1) & vcache_mask;
+    lock = &cache_locks[b % CACHE_LOCKS];
+    pthread_spin_lock(lock);
+    for (i = 0, e = vcache[b].e; i < CACHE_WAYS; i++, e++) {
+        if (e->expires && e->ip == ip) {
+            victim = e;
+            break;
+        }
+        if (!victim && e->expires <= now) {
+            victim = e;
+        }
+    }
+    if (!victim) {
+        for (i = 0, e = vcache[b].e; i < CACHE_WAYS; i++, e++) {
+            if (!e->ref && (!victim || e->expires < victim->expires)) {
+                victim = e;
+            }
+        }
+        if (!victim) {
+            for (i = 0, e = vcache[b].e; i < CACHE_WAYS; i++, e++) {
+                e->ref = 0;
+                if (!victim || e->expires < victim->expires) {
+                    victim = e;
+                }
+            }
+        }
+        victim->ref = 0;
+    } else if (victim->ip != ip || !victim->expires) {
+        victim->ref = 0;
+    }
+    victim->ip = ip;
+    victim->listed = listed;
+    victim->expires = now + ttl;
+    pthread_spin_unlock(lock);
+}
+
+
+void vcache_flush(void) {
+    unsigned int b;
+
+    if (!vcache) {
+        return;
+    }
+    for (b = 0; b <= vcache_mask; b++) {
+        pthread_spin_lock(&cache_locks[b % CACHE_LOCKS]);
+        memset(&vcache[b], 0, sizeof(vbucket_t));
+        pthread_spin_unlock(&cache_locks[b % CACHE_LOCKS]);
+    }
+}
@@ -0,0 +1,70 @@
+/*
+   rblpolicyd - a policy daemon for Postfix (http://www.postfix.org/),
+   which allows combining different RBLs with weights.
+
+   $Id$
+   Public DNS answer and verdict cache interface
+
+   Copyright (C) 2004 Thomas Lamy
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* The verdict cache records listing zones as bits of a 64 bit mask */
+#define VCACHE_MAXZONES    64
+
+/* Longest time anything is cached, s; -n and -N can not exceed it */
+#define CACHE_TTL_MAX      604800
+
+/* A cached RBL answer */
+typedef struct {
+    char listed;           /* address is listed in the zone */
+    unsigned int addr;     /* 127.0.0.x return code, network byte order */
+    unsigned int ttl;      /* seconds left */
+} cacheres_t;
+
+int cache_init(unsigned int kbytes);
+
+void cache_free(void);
+
+int cache_get(unsigned int ip, int zone, cacheres_t *res);
+
+void cache_put(unsigned int ip, int zone, int listed, unsigned int addr, unsigned int ttl);
+
+void cache_flush(void);
+
+void cache_drop_zone(int zone);
+
+int vcache_init(unsigned int kbytes);
+
+void vcache_free(void);
+
+int vcache_get(unsigned int ip, unsigned long long *listed, unsigned int *ttl);
+
+void vcache_put(unsigned int ip, unsigned long long listed, unsigned int ttl);
+
+void vcache_flush(void);
+
+unsigned int cache_now(void);
+
+#endif
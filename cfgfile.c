@@ -27,8 +27,11 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 
 #include "cfgfile.h"
+#include "dns.h"
+#include "xmalloc.h"
 #include "globals.h"
 
 
@@ -62,7 +65,11 @@ static void cfg_cleanline(char *line) {
 }
 
 
-cfgitem_t *cfg_read(char *filename) {
+/** cfgitem_t *cfg_read(char *filename, nsitem_t **nameservers)
+ * Read the RBL list from filename. "nameserver <ip>[:<port>]" lines are
+ * appended to *nameservers, or ignored if nameservers is NULL.
+ */
+cfgitem_t *cfg_read(char *filename, nsitem_t **nameservers) {
     FILE *c;
     char buf[MAXLINE];
     cfgitem_t *first = NULL, *current = NULL, *item = NULL, *last = NULL;
@@ -111,6 +118,31 @@ cfgitem_t *cfg_read(char *filename) {
         }
         // dbg("> domain='%s'\n", temp);
 
+        if (strcmp(temp, "nameserver") == 0) {
+            nsitem_t *ns, **tail;
+
+            while (*x && isspace(*x)) {
+                x++;
+            }
+            if ((ns = calloc(1, sizeof(nsitem_t))) == NULL) {
+                syslog(LOG_ERR, "Out of memory at %s:%d allocating %zu bytes\n", __FILE__, __LINE__, sizeof(nsitem_t));
+                goto err_cleanup;
+            }
+            if (dns_parse_ns(x, &ns->addr) != 0) {
+                syslog(LOG_ERR, "%s line %d: invalid nameserver '%s'\n", filename, lineno, x);
+                fprintf(stderr, "%s: %s line %d: invalid nameserver '%s'\n", progname, filename, lineno, x);
+                free(ns);
+                goto err_cleanup;
+            }
+            if (!nameservers) {
+                free(ns);
+                continue;
+            }
+            for (tail = nameservers; *tail; tail = &(*tail)->next);
+            *tail = ns;
+            continue;
+        }
+
         if ((current = calloc(1, sizeof(cfgitem_t))) == NULL) {
             syslog(LOG_ERR, "Out of memory at %s:%d allocating %d bytes\n", __FILE__, __LINE__, sizeof(cfgitem_t));
             fprintf(stderr, "%s: Out of memory at %s:%d allocating %d bytes\n", progname, __FILE__, __LINE__,
@@ -118,6 +150,14 @@ cfgitem_t *cfg_read(char *filename) {
             goto err_cleanup;
         }
         current->rbldomain = strdup(temp);
+        /* Query names are built from this for every request */
+        current->qsuffix = malloc(DNS_MAXNAME);
+        if (!current->qsuffix
+            || (current->qsuffixlen = dns_wirename(current->qsuffix, DNS_MAXNAME - 16, temp)) < 0) {
+            syslog(LOG_ERR, "%s line %d: invalid RBL domain '%s'\n", filename, lineno, temp);
+            fprintf(stderr, "%s: %s line %d: invalid RBL domain '%s'\n", progname, filename, lineno, temp);
+            goto err_cleanup;
+        }
         while (*x && isspace(*x)) {
             x++;
         }
@@ -134,6 +174,7 @@ cfgitem_t *cfg_read(char *filename) {
             goto err_cleanup;
         }
         current->weight = (short) weight;
+        current->index = last ? last->index + 1 : 0;
 
         if (last) {
             last->next = current;
@@ -161,12 +202,72 @@ void cfg_free(cfgitem_t **list) {
         if (item->rbldomain) {
             free(item->rbldomain);
         }
+        if (item->qsuffix) {
+            free(item->qsuffix);
+        }
         free(item);
         item = next;
     }
     *list = NULL;
 }
 
+/*
+ * Compile list into a zone table, allocated as a single block; free()
+ * it when done. The list itself is not needed afterwards.
+ */
+zonetab_t *cfg_compile(cfgitem_t *list) {
+    zonetab_t *tab;
+    cfgitem_t *item;
+    char *p;
+    size_t names = 0, wire = 0;
+    int n = 0, z;
+
+    for (item = list; item; item = item->next) {
+        n++;
+        names += strlen(item->rbldomain) + 1;
+        wire += item->qsuffixlen;
+    }
+    /* Widest fields first, so each array is aligned */
+    tab = xmalloc(sizeof(zonetab_t) + n * (2 * sizeof(unsigned int) + 2 * sizeof(short) + 1) + names + wire);
+    p = (char *) (tab + 1);
+    tab->nzones = n;
+    tab->name = (unsigned int *) p;
+    p += n * sizeof(unsigned int);
+    tab->qsuffix = (unsigned int *) p;
+    p += n * sizeof(unsigned int);
+    tab->weight = (short *) p;
+    p += n * sizeof(short);
+    tab->index = (short *) p;
+    p += n * sizeof(short);
+    tab->qsuffixlen = (unsigned char *) p;
+    p += n;
+    tab->names = p;
+    tab->wire = (unsigned char *) p + names;
+    names = wire = 0;
+    for (item = list, z = 0; item; item = item->next, z++) {
+        tab->weight[z] = item->weight;
+        tab->index[z] = item->index;
+        tab->name[z] = names;
+        strcpy(tab->names + names, item->rbldomain);
+        names += strlen(item->rbldomain) + 1;
+        tab->qsuffix[z] = wire;
+        tab->qsuffixlen[z] = item->qsuffixlen;
+        memcpy(tab->wire + wire, item->qsuffix, item->qsuffixlen);
+        wire += item->qsuffixlen;
+    }
+    return tab;
+}
+
+
+void cfg_free_ns(nsitem_t **list) {
+    nsitem_t *next = NULL, *item;
+    for (item = *list; item; item = next) {
+        next = item->next;
+        free(item);
+    }
+    *list = NULL;
+}
+
 void cfg_dump(cfgitem_t *item) {
     printf("<rblservers>\n");
     while (item) {
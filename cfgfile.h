@@ -29,24 +29,50 @@
 
 #define DEFAULT_CFGFILE    "/etc/rbl-policyd.conf"
 
-#define NUM_RTT    16
-
 typedef struct _cfgitem {
     char *rbldomain;        /* RBL Domain */
+    unsigned char *qsuffix;    /* rbldomain in DNS wire format */
+    short qsuffixlen;
     short weight;        /* Weight/Score */
-    unsigned int questions;        /* How often asked */
-    unsigned int positive;        /* positive answers */
-    unsigned int rtt[NUM_RTT];    /* last 16 answer times */
-    unsigned char rttindex;        /* Current position in ring buffer */
+    short index;        /* Position in the list, used as cache key */
     struct _cfgitem *next;
 } cfgitem_t;
 
+/*
+ * The zone list compiled for the workers, in one block with an array per
+ * field: walking the weights or indices of all zones touches a cache line
+ * or two. Never changed after cfg_compile().
+ */
+typedef struct {
+    int nzones;
+    unsigned int *name;        /* offset of the domain in names */
+    unsigned int *qsuffix;     /* offset of the wire format domain in wire */
+    short *weight;
+    short *index;              /* cache key, bit in the verdict mask if < 64 */
+    unsigned char *qsuffixlen;
+    char *names;
+    unsigned char *wire;
+} zonetab_t;
+
+#define ZONE_NAME(t, z)       ((t)->names + (t)->name[z])
+#define ZONE_QSUFFIX(t, z)    ((t)->wire + (t)->qsuffix[z])
+
+/* Upstream resolver, as read from the config file or resolv.conf */
+typedef struct _nsitem {
+    struct sockaddr_in addr;
+    struct _nsitem *next;
+} nsitem_t;
+
 #define MAXLINE 1024
 
-cfgitem_t *cfg_read(char *filename);
+cfgitem_t *cfg_read(char *filename, nsitem_t **nameservers);
 
 void cfg_free(cfgitem_t **ptr);
 
+zonetab_t *cfg_compile(cfgitem_t *list);
+
+void cfg_free_ns(nsitem_t **list);
+
 void cfg_dump(cfgitem_t *ptr);
 
 void dbg(const char *fmt, ...);
@@ -0,0 +1,56 @@
+/*
+   rblpolicyd - a policy daemon for Postfix (http://www.postfix.org/),
+   which allows combining different RBLs with weights.
+
+   $Id$
+   Stand-ins for the hooks dns.c calls, for the check programs
+
+   Copyright (C) 2004 Thomas Lamy
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdarg.h>
+#include <sys/time.h>
+
+#include "stats.h"
+
+/* dns.c reports to the stats module and the debug log, not needed here */
+void dbg(const char *fmt, ...) {
+}
+
+void stats_solver_thr(int num) {
+}
+
+void stats_solver_time(struct timeval *start, struct timeval *end) {
+}
+
+void stats_solver_wait(struct timeval *start, struct timeval *end) {
+}
+
+void stats_solver_lookup(int coalesced) {
+}
+
+void stats_solver_inflight(int num) {
+}
+
+void stats_solver_hedge(int won) {
+}
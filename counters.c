@@ -0,0 +1,262 @@
+/*
+   rblpolicyd - a policy daemon for Postfix (http://www.postfix.org/),
+   which allows combining different RBLs with weights.
+
+   $Id$
+   Counters kept per thread and summed when read
+
+   Copyright (C) 2004 Thomas Lamy
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+
+#include <stdio.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <string.h>
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <pthread.h>
+
+#include "system.h"
+
+#include "counters.h"
+#include "xmalloc.h"
+
+/*
+ * A counter set is an array of slots. Every thread updating it gets a
+ * block of its own, padded to whole cache lines, and only ever writes
+ * there; readers add up the blocks of all threads. Blocks are never
+ * freed before the set, so counts survive the thread.
+ */
+
+typedef struct ctrblock {
+    struct ctrblock *next;
+} ctrblock_t;
+
+#define CTR_LINE       64
+#define CTR_HDR        CTR_LINE    /* block header, keeps the slots aligned */
+
+struct ctrset {
+    unsigned long id;      /* never reused, unlike the address */
+    int nslots;
+    size_t size;           /* bytes per block incl. header */
+    pthread_mutex_t lock;  /* adding blocks */
+    ctrblock_t *blocks;
+};
+
+/* The slots of the sets this thread used last */
+static __thread struct {
+    unsigned long id;
+    ctr_t *v;
+} ctr_cache[CTR_CACHE];
+static __thread int ctr_next = 0;
+
+static unsigned long ctr_ids = 0;
+
+
+#define CTR_SLOTS(b)    ((ctr_t *) ((char *) (b) + CTR_HDR))
+
+
+ctrset_t *ctr_new(int nslots) {
+    ctrset_t *set;
+
+    set = xmalloc(sizeof(ctrset_t));
+    set->id = __atomic_add_fetch(&ctr_ids, 1, __ATOMIC_RELAXED);
+    set->nslots = nslots;
+    set->size = CTR_HDR + (nslots * sizeof(ctr_t) + CTR_LINE - 1) / CTR_LINE * CTR_LINE;
+    pthread_mutex_init(&set->lock, NULL);
+    set->blocks = NULL;
+    return set;
+}
+
+
+/*
+ * Free set and all blocks. No thread may use it any more.
+ */
+void ctr_free(ctrset_t *set) {
+    ctrblock_t *b;
+
+    if (!set) {
+        return;
+    }
+    while ((b = set->blocks) != NULL) {
+        set->blocks = b->next;
+        free(b);
+    }
+    pthread_mutex_destroy(&set->lock);
+    free(set);
+}
+
+
+/*
+ * Add a zeroed block to set. The calling thread owns it.
+ */
+static ctr_t *ctr_add(ctrset_t *set) {
+    ctrblock_t *b;
+
+    if (posix_memalign((void **) &b, CTR_LINE, set->size) != 0) {
+        b = xmalloc(set->size);
+    }
+    memset(b, 0, set->size);
+    pthread_mutex_lock(&set->lock);
+    b->next = set->blocks;
+    __atomic_store_n(&set->blocks, b, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&set->lock);
+    return CTR_SLOTS(b);
+}
+
+
+/*
+ * The calling thread's slots of set, created on first use
+ */
+ctr_t *ctr_local(ctrset_t *set) {
+    int i;
+
+    for (i = 0; i < CTR_CACHE; i++) {
+        if (ctr_cache[i].id == set->id) {
+            return ctr_cache[i].v;
+        }
+    }
+    /* A thread dropping a set from its cache and coming back later gets
+     * another block; the sums stay right */
+    i = ctr_next;
+    ctr_next = (ctr_next + 1) % CTR_CACHE;
+    ctr_cache[i].id = set->id;
+    ctr_cache[i].v = ctr_add(set);
+    return ctr_cache[i].v;
+}
+
+
+/*
+ * Sum of one slot over all threads. Not a snapshot: counts made
+ * meanwhile may or may not be included.
+ */
+unsigned long long ctr_sum(ctrset_t *set, int slot) {
+    ctrblock_t *b;
+    unsigned long long sum = 0;
+
+    for (b = __atomic_load_n(&set->blocks, __ATOMIC_ACQUIRE); b; b = b->next) {
+        sum += CTR_GET(CTR_SLOTS(b), slot);
+    }
+    return sum;
+}
+
+
+/*
+ * Sums of slots first to first + n - 1 over all threads, in one pass
+ */
+void ctr_sums(ctrset_t *set, int first, int n, ctr_t *sums) {
+    ctrblock_t *b;
+    ctr_t *v;
+    int i;
+
+    memset(sums, 0, n * sizeof(ctr_t));
+    for (b = __atomic_load_n(&set->blocks, __ATOMIC_ACQUIRE); b; b = b->next) {
+        v = CTR_SLOTS(b) + first;
+        for (i = 0; i < n; i++) {
+            sums[i] += CTR_GET(v, i);
+        }
+    }
+}
+
+
+/*
+ * Histogram bucket of us. Below 2 * HIST_SUB the bucket is the value, above
+ * that it is the position of the highest bit and the HIST_BITS below it.
+ */
+int hist_bucket(unsigned long us) {
+    int m, b;
+
+    if (us < HIST_SUB) {
+        return (int) us;
+    }
+    m = (int) (8 * sizeof(unsigned long)) - 1 - __builtin_clzl(us);
+    b = (m - HIST_BITS + 1) * HIST_SUB + (int) ((us >> (m - HIST_BITS)) & (HIST_SUB - 1));
+    return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+
+/*
+ * Middle of the values counted in bucket
+ */
+unsigned long hist_value(int bucket) {
+    int m;
+
+    if (bucket < 2 * HIST_SUB) {
+        return bucket;
+    }
+    m = bucket / HIST_SUB + HIST_BITS - 1;
+    return ((unsigned long) (HIST_SUB + bucket % HIST_SUB) << (m - HIST_BITS))
+           + ((1UL << (m - HIST_BITS)) >> 1);
+}
+
+
+/*
+ * Value below which a fraction p of the values in the buckets h fall,
+ * 0 if h is empty
+ */
+unsigned long hist_percentile(const ctr_t *h, double p) {
+    unsigned long long total = 0, rank, seen = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        total += h[i];
+    }
+    if (!total) {
+        return 0;
+    }
+    rank = (unsigned long long) (p * total + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        if ((seen += h[i]) >= rank) {
+            break;
+        }
+    }
+    return hist_value(i < HIST_BUCKETS ? i : HIST_BUCKETS - 1);
+}
+
+
+unsigned long hist_max(const ctr_t *h) {
+    int i;
+
+    for (i = HIST_BUCKETS - 1; i > 0 && !h[i]; i--);
+    return h[i] ? hist_value(i) : 0;
+}
+
+
+/*
+ * Print p50/p95/p99/max of h in ms to buf, "-" if h is empty
+ */
+char *hist_format(char *buf, int size, const ctr_t *h) {
+    if (!hist_max(h) && !h[0]) {
+        snprintf(buf, size, "-");
+    } else {
+        snprintf(buf, size, "%0.1f/%0.1f/%0.1f/%0.1f", hist_percentile(h, 0.50) / 1000.0,
+                 hist_percentile(h, 0.95) / 1000.0, hist_percentile(h, 0.99) / 1000.0, hist_max(h) / 1000.0);
+    }
+    return buf;
+}
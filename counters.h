@@ -0,0 +1,77 @@
+/*
+   rblpolicyd - a policy daemon for Postfix (http://www.postfix.org/),
+   which allows combining different RBLs with weights.
+
+   $Id$
+   Public per-thread counter interface
+
+   Copyright (C) 2004 Thomas Lamy
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#ifndef __COUNTERS_H
+#define __COUNTERS_H
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define CTR_CACHE      4       /* sets a thread remembers its slots of */
+
+/*
+ * A histogram is HIST_BUCKETS consecutive slots counting values in
+ * microseconds: exact below 2 * HIST_SUB, then HIST_SUB buckets per power
+ * of two, so a bucket is at most 1/HIST_SUB of its value wide.
+ */
+#define HIST_BITS      3
+#define HIST_SUB       (1 << HIST_BITS)
+#define HIST_BUCKETS   192     /* up to 2^26 us, about 67 s */
+
+typedef struct ctrset ctrset_t;
+
+/* One slot, a machine word so that loads and stores don't tear */
+typedef unsigned long ctr_t;
+
+/* Slot i of a thread's own block: relaxed loads and stores, no locked ops */
+#define CTR_GET(v, i)       __atomic_load_n(&(v)[i], __ATOMIC_RELAXED)
+#define CTR_SET(v, i, x)    __atomic_store_n(&(v)[i], (x), __ATOMIC_RELAXED)
+#define CTR_ADD(v, i, x)    CTR_SET(v, i, CTR_GET(v, i) + (x))
+
+/* Count us in the histogram at slot base */
+#define HIST_ADD(v, base, us)    CTR_ADD(v, (base) + hist_bucket(us), 1)
+
+ctrset_t *ctr_new(int nslots);
+
+void ctr_free(ctrset_t *set);
+
+ctr_t *ctr_local(ctrset_t *set);
+
+unsigned long long ctr_sum(ctrset_t *set, int slot);
+
+void ctr_sums(ctrset_t *set, int first, int n, ctr_t *sums);
+
+int hist_bucket(unsigned long us);
+
+unsigned long hist_value(int bucket);
+
+unsigned long hist_percentile(const ctr_t *h, double p);
+
+unsigned long hist_max(const ctr_t *h);
+
+char *hist_format(char *buf, int size, const ctr_t *h);
+
+#endif
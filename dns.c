@@ -0,0 +1,1237 @@
+/*
+   rblpolicyd - a policy daemon for Postfix (http://www.postfix.org/),
+   which allows combining different RBLs with weights.
+
+   $Id$
+   Asynchronous DNS client: all RBL queries are multiplexed over a few
+   non-blocking UDP sockets and served by a single event thread.
+
+   Copyright (C) 2004 Thomas Lamy
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+
+#include <stdio.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <time.h>
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#if HAVE_CTYPE_H
+#include <ctype.h>
+#endif
+
+#include <pthread.h>
+
+#include "system.h"
+
+#include "cfgfile.h"
+#include "dns.h"
+#include "counters.h"
+#include "stats.h"
+#include "globals.h"
+
+#define DNS_MAXSOCK     16
+#define DNS_ATTEMPT_MS  1000    /* ms per attempt, unless the caller says otherwise */
+#define DNS_ATTEMPTS    3       /* attempts, each to another upstream if possible */
+#define DNS_PENDING     8192    /* hash buckets of lookups in flight, power of 2 */
+
+#define DNS_HEDGE_PCT   5       /* hedges allowed per 100 queries */
+#define DNS_HEDGE_BURST 10      /* hedges the budget saves up at most */
+
+#define NS_EWMA_SHIFT   3       /* each attempt weighs 1/8 in the average */
+#define NS_EJECT_FAILS  5       /* failed attempts in a row that eject an upstream */
+#define NS_EJECT_MS     5000    /* for that long */
+
+/* Counters of an upstream; NS_RTT is a histogram of attempt times */
+#define NS_SENT         0
+#define NS_ANSWERS      1
+#define NS_SERVFAILS    2
+#define NS_TIMEOUTS     3
+#define NS_EJECTED      4
+#define NS_RTT          5
+#define NS_SLOTS        (NS_RTT + HIST_BUCKETS)
+
+#define DNS_T_A         1
+#define DNS_T_SOA       6
+#define DNS_C_IN        1
+
+/* A query in flight */
+typedef struct dnsq {
+    unsigned short id;
+    unsigned char sock;        /* index into dns_socks */
+    unsigned char ns;          /* index into dns_ns, of the last attempt */
+    unsigned char tries;       /* attempts made so far */
+    int tmo;                   /* ms per attempt */
+    unsigned char pkt[DNS_MAXPKT];
+    int pktlen;
+    int qlen;                  /* length of the question section */
+    long expires;              /* ms (monotonic) when the attempt times out */
+    long hedge_at;             /* ms when to send a hedge, 0 = not (any more) */
+    long hexpires;             /* ms when the hedge times out */
+    long deadline;             /* the earliest of them, the timer */
+    int tslot;                 /* index into tmo_heap, -1 = no timer */
+    int hedge;                 /* ms after the first attempt to hedge, 0 = never */
+    unsigned short hid;        /* ID of the hedge */
+    unsigned char hns;         /* index into dns_ns, of the hedge */
+    unsigned char hedged;      /* hedge in flight */
+    struct timeval hsent;      /* hedge was sent */
+    struct timeval queued;     /* dns_query() was called */
+    struct timeval started;    /* first attempt was sent */
+    struct timeval sent;       /* last attempt was sent */
+    dns_cb_t cb;
+    void *arg;
+    unsigned int hash;         /* of the question */
+    struct dnsq *hnext;        /* dns_pending chain */
+    struct dnsq *waiters;      /* same question asked meanwhile */
+    struct dnsq *next;         /* submit queue / waiters */
+} dnsq_t;
+
+static int dns_socks[DNS_MAXSOCK];
+static int dns_nsock = 0;
+/*
+ * An upstream resolver. Only the event thread changes it; the stats
+ * read it with relaxed atomics.
+ */
+typedef struct {
+    struct sockaddr_in addr;
+    unsigned int ewma;         /* us, average attempt time, timeouts included */
+    int outstanding;           /* attempts waiting for an answer */
+    int fails;                 /* failed attempts since the last good answer */
+    long ejected;              /* dns_msec() until which it is left out, 0 = in use */
+    ctr_t ctr[NS_SLOTS];
+} upstream_t;
+
+static upstream_t dns_ns[DNS_MAXNS];
+static int dns_nns = 0;
+static ctr_t ns_seen[DNS_MAXNS][HIST_BUCKETS];    /* as of the last dns_log_stats() */
+static int dns_wakeup[2] = {-1, -1};
+static pthread_t dns_tid;
+static volatile int dns_stop = 0;
+
+/* Only touched by the event thread */
+static dnsq_t *dns_ids[65536];
+static dnsq_t *dns_pending[DNS_PENDING];    /* sent queries by question */
+static dnsq_t **tmo_heap = NULL;    /* timers of sent queries, by deadline */
+static int tmo_n = 0;
+static int hedge_credit = 0;        /* hedges allowed, in 1/100 */
+static unsigned int dns_rnd = 0;
+static unsigned int dns_nextsock = 0;
+
+/* Protected by dns_lock */
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_space = PTHREAD_COND_INITIALIZER;
+static dnsq_t *submit_head = NULL;
+static dnsq_t *submit_tail = NULL;
+static int dns_inflight = 0;
+static int dns_cap = 0;
+
+
+static void dns_clock(struct timeval *tv) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    tv->tv_sec = ts.tv_sec;
+    tv->tv_usec = ts.tv_nsec / 1000;
+}
+
+
+static long dns_msec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+
+/* xorshift32; good enough to make query IDs unpredictable to off-path senders */
+static unsigned short dns_random(void) {
+    dns_rnd ^= dns_rnd << 13;
+    dns_rnd ^= dns_rnd >> 17;
+    dns_rnd ^= dns_rnd << 5;
+    return (unsigned short) (dns_rnd >> 8);
+}
+
+
+static void dns_seed(void) {
+    int fd;
+
+    if ((fd = open("/dev/urandom", O_RDONLY)) >= 0) {
+        if (read(fd, &dns_rnd, sizeof(dns_rnd)) != sizeof(dns_rnd)) {
+            dns_rnd = 0;
+        }
+        close(fd);
+    }
+    if (dns_rnd == 0) {
+        dns_rnd = (unsigned int) time(NULL) ^ ((unsigned int) getpid() << 16) ^ 0x9e3779b9;
+    }
+}
+
+
+const char *dns_status(dnsstatus_t status) {
+    switch (status) {
+        case DNS_LISTED:
+            return "listed";
+        case DNS_NOTLISTED:
+            return "not listed";
+        case DNS_SERVFAIL:
+            return "server failure";
+        case DNS_TIMEOUT:
+            return "timeout";
+        case DNS_ERROR:
+            return "error";
+    }
+    return "";
+}
+
+
+/*
+ * Parse "a.b.c.d" or "a.b.c.d:port" into sin
+ */
+int dns_parse_ns(const char *str, struct sockaddr_in *sin) {
+    char buf[64];
+    char *p;
+    long port = 53;
+
+    if (strlen(str) >= sizeof(buf)) {
+        return -1;
+    }
+    strcpy(buf, str);
+    if ((p = strchr(buf, ':')) != NULL) {
+        *p++ = '\0';
+        port = strtol(p, &p, 10);
+        if (*p != '\0' || port <= 0 || port > 65535) {
+            return -1;
+        }
+    }
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons((unsigned short) port);
+    if (inet_pton(AF_INET, buf, &sin->sin_addr) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Append all IPv4 nameservers from a resolv.conf style file to list.
+ * Returns number of servers found, -1 if the file can not be read.
+ */
+int dns_read_resolvconf(const char *filename, nsitem_t **list) {
+    FILE *f;
+    char buf[MAXLINE];
+    char *x, *y;
+    nsitem_t *ns, **tail;
+    int found = 0;
+
+    if ((f = fopen(filename, "r")) == NULL) {
+        return -1;
+    }
+    for (tail = list; *tail; tail = &(*tail)->next);
+    while (fgets(buf, MAXLINE - 1, f)) {
+        if (strncmp(buf, "nameserver", 10) != 0 || !isspace(buf[10])) {
+            continue;
+        }
+        for (x = buf + 10; *x && isspace(*x); x++);
+        for (y = x; *y && !isspace(*y); y++);
+        *y = '\0';
+        if ((ns = calloc(1, sizeof(nsitem_t))) == NULL) {
+            break;
+        }
+        if (dns_parse_ns(x, &ns->addr) != 0) {
+            /* IPv6 or garbage */
+            dbg("%s: ignoring nameserver '%s'", filename, x);
+            free(ns);
+            continue;
+        }
+        *tail = ns;
+        tail = &ns->next;
+        found++;
+    }
+    fclose(f);
+    return found;
+}
+
+
+/*
+ * Convert a dotted name to wire format (labels and the root label) in
+ * buf of size bytes. Returns the length, or -1 if the name is invalid.
+ */
+int dns_wirename(unsigned char *buf, int size, const char *name) {
+    unsigned char *p = buf;
+    unsigned char *label;
+    const char *c;
+
+    if (size > DNS_MAXNAME) {
+        size = DNS_MAXNAME;
+    }
+    label = p++;
+    for (c = name; *c; c++) {
+        if (p - buf >= size - 1) {
+            return -1;
+        }
+        if (*c == '.') {
+            if (p - label - 1 == 0 || p - label - 1 > 63) {
+                return -1;
+            }
+            *label = p - label - 1;
+            label = p++;
+        } else {
+            *p++ = *c;
+        }
+    }
+    if (p - label - 1 > 63) {
+        return -1;
+    }
+    *label = p - label - 1;
+    if (*label) {
+        *p++ = 0;    /* root label */
+    }
+    return p - buf;
+}
+
+
+/* Octets 0..255 as DNS labels: length byte and the digits */
+static unsigned char dns_octets[256][4];
+static pthread_once_t dns_octets_once = PTHREAD_ONCE_INIT;
+
+static void dns_octets_init(void) {
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        if (i >= 100) {
+            dns_octets[i][0] = 3;
+            dns_octets[i][1] = '0' + i / 100;
+            dns_octets[i][2] = '0' + i / 10 % 10;
+            dns_octets[i][3] = '0' + i % 10;
+        } else if (i >= 10) {
+            dns_octets[i][0] = 2;
+            dns_octets[i][1] = '0' + i / 10;
+            dns_octets[i][2] = '0' + i % 10;
+        } else {
+            dns_octets[i][0] = 1;
+            dns_octets[i][1] = '0' + i;
+        }
+    }
+}
+
+
+/*
+ * Build the wire format name of ip (host byte order) in an RBL zone:
+ * the reversed octets followed by the zone's prebuilt wire suffix.
+ * buf must hold DNS_MAXNAME bytes. Returns the length, or -1.
+ */
+int dns_rblname(unsigned char *buf, unsigned int ip, const unsigned char *suffix, int suffixlen) {
+    unsigned char *p = buf;
+    const unsigned char *o;
+    int i;
+
+    if (suffixlen > DNS_MAXNAME - 16) {
+        return -1;
+    }
+    pthread_once(&dns_octets_once, dns_octets_init);
+    for (i = 0; i < 4; i++, ip >>= 8) {
+        o = dns_octets[ip & 0xff];
+        memcpy(p, o, 4);    /* may copy junk past the label, overwritten next */
+        p += o[0] + 1;
+    }
+    memcpy(p, suffix, suffixlen);
+    return p - buf + suffixlen;
+}
+
+
+/*
+ * Encode an A/IN query for the wire format qname into q->pkt. The ID is
+ * filled in when the query is sent.
+ */
+static void dns_encode(dnsq_t *q, const unsigned char *qname, int qlen) {
+    unsigned char *p = q->pkt;
+
+    memset(p, 0, 12);
+    p[2] = 0x01;    /* RD */
+    p[5] = 1;       /* QDCOUNT */
+    p += 12;
+    memcpy(p, qname, qlen);
+    p += qlen;
+    *p++ = 0;
+    *p++ = DNS_T_A;
+    *p++ = 0;
+    *p++ = DNS_C_IN;
+    q->pktlen = p - q->pkt;
+    q->qlen = q->pktlen - 12;
+}
+
+
+/*
+ * Skip a (possibly compressed) domain name, return offset after it or -1
+ */
+static int dns_skipname(const unsigned char *pkt, int len, int off) {
+    while (off < len) {
+        if (pkt[off] == 0) {
+            return off + 1;
+        }
+        if ((pkt[off] & 0xc0) == 0xc0) {
+            return off + 2 <= len ? off + 2 : -1;
+        }
+        if (pkt[off] & 0xc0) {
+            return -1;
+        }
+        off += pkt[off] + 1;
+    }
+    return -1;
+}
+
+
+#define GET16(p) ((unsigned int) (p)[0] << 8 | (p)[1])
+#define GET32(p) ((unsigned int) (p)[0] << 24 | (unsigned int) (p)[1] << 16 | (unsigned int) (p)[2] << 8 | (p)[3])
+/* RFC 2181, 8: a TTL with the top bit set is taken as 0 */
+#define GETTTL(p) (GET32(p) & 0x80000000 ? 0 : GET32(p))
+
+/*
+ * Parse an answer to q. Returns 0 if res holds a final result, 1 if the
+ * upstream failed and the query should be retried, -1 if the packet does
+ * not belong to q.
+ */
+static int dns_parse(dnsq_t *q, const unsigned char *pkt, int len, dnsresult_t *res) {
+    int off, i, an, ns, rcode;
+    unsigned int type, class, ttl, rdlen;
+    unsigned int negttl = 0;
+
+    if (len < 12 + q->qlen || !(pkt[2] & 0x80) || GET16(pkt + 4) != 1) {
+        return -1;
+    }
+    /* The question must be ours (names compare case-insensitive) */
+    for (i = 0; i < q->qlen; i++) {
+        if (tolower(pkt[12 + i]) != tolower(q->pkt[12 + i])) {
+            return -1;
+        }
+    }
+    rcode = pkt[3] & 0x0f;
+    if (rcode != 0 && rcode != 3) {
+        return 1;
+    }
+    an = GET16(pkt + 6);
+    ns = GET16(pkt + 8);
+    off = 12 + q->qlen;
+
+    memset(res, 0, sizeof(*res));
+    res->status = DNS_NOTLISTED;
+    for (i = 0; i < an + ns; i++) {
+        if ((off = dns_skipname(pkt, len, off)) < 0 || off + 10 > len) {
+            break;
+        }
+        type = GET16(pkt + off);
+        class = GET16(pkt + off + 2);
+        ttl = GETTTL(pkt + off + 4);
+        rdlen = GET16(pkt + off + 8);
+        off += 10;
+        if (off + rdlen > len) {
+            break;
+        }
+        if (i < an && rcode == 0 && type == DNS_T_A && class == DNS_C_IN && rdlen == 4) {
+            if (pkt[off] == 127 && res->status != DNS_LISTED) {
+                res->status = DNS_LISTED;
+                memcpy(&res->addr, pkt + off, 4);
+                res->ttl = ttl;
+            } else if (!res->addr) {
+                memcpy(&res->addr, pkt + off, 4);
+                res->ttl = ttl;
+            }
+        } else if (i >= an && type == DNS_T_SOA) {
+            /* RFC 2308: negative TTL is min(SOA TTL, SOA MINIMUM) */
+            int m = dns_skipname(pkt, len, off);
+            if (m > 0) {
+                m = dns_skipname(pkt, len, m);
+            }
+            if (m > 0 && m + 20 <= off + rdlen) {
+                negttl = GETTTL(pkt + m + 16);
+                if (ttl < negttl) {
+                    negttl = ttl;
+                }
+            }
+        }
+        off += rdlen;
+    }
+    if (res->status != DNS_LISTED && !res->addr) {
+        res->ttl = negttl;
+    }
+    return 0;
+}
+
+
+/*
+ * Timers are a binary heap: attempt timeouts differ per zone, and hedges
+ * fire in between
+ */
+static void tmo_place(dnsq_t *q, int i) {
+    tmo_heap[i] = q;
+    q->tslot = i;
+}
+
+
+static void tmo_up(int i) {
+    dnsq_t *q = tmo_heap[i];
+
+    while (i > 0 && tmo_heap[(i - 1) / 2]->deadline > q->deadline) {
+        tmo_place(tmo_heap[(i - 1) / 2], i);
+        i = (i - 1) / 2;
+    }
+    tmo_place(q, i);
+}
+
+
+static void tmo_down(int i) {
+    dnsq_t *q = tmo_heap[i];
+    int c;
+
+    while ((c = 2 * i + 1) < tmo_n) {
+        if (c + 1 < tmo_n && tmo_heap[c + 1]->deadline < tmo_heap[c]->deadline) {
+            c++;
+        }
+        if (tmo_heap[c]->deadline >= q->deadline) {
+            break;
+        }
+        tmo_place(tmo_heap[c], i);
+        i = c;
+    }
+    tmo_place(q, i);
+}
+
+
+static void tmo_unlink(dnsq_t *q) {
+    dnsq_t *last;
+    int i = q->tslot;
+
+    if (i < 0) {
+        return;
+    }
+    q->tslot = -1;
+    last = tmo_heap[--tmo_n];
+    if (last != q) {
+        tmo_place(last, i);
+        tmo_down(i);
+        tmo_up(last->tslot);
+    }
+}
+
+
+/*
+ * Start the timer of q: the attempt timeout, or the hedge or its timeout
+ * if that comes first
+ */
+static void tmo_insert(dnsq_t *q) {
+    q->deadline = q->expires;
+    if (q->hedge_at && q->hedge_at < q->deadline) {
+        q->deadline = q->hedge_at;
+    }
+    if (q->hedged && q->hexpires < q->deadline) {
+        q->deadline = q->hexpires;
+    }
+    tmo_place(q, tmo_n++);
+    tmo_up(q->tslot);
+}
+
+
+/*
+ * Sent query asking the same as q, if any
+ */
+static dnsq_t *dns_pending_find(dnsq_t *q) {
+    dnsq_t *p;
+
+    for (p = dns_pending[q->hash & (DNS_PENDING - 1)]; p; p = p->hnext) {
+        if (p->hash == q->hash && p->qlen == q->qlen && memcmp(p->pkt + 12, q->pkt + 12, q->qlen) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+
+static void dns_pending_unlink(dnsq_t *q) {
+    dnsq_t **pp;
+
+    for (pp = &dns_pending[q->hash & (DNS_PENDING - 1)]; *pp; pp = &(*pp)->hnext) {
+        if (*pp == q) {
+            *pp = q->hnext;
+            break;
+        }
+    }
+}
+
+
+/*
+ * Hand the result to the owner and anyone waiting for the same answer,
+ * and free them
+ */
+static void dns_finish(dnsq_t *q, dnsresult_t *res) {
+    dnsresult_t wres;
+    struct timeval now;
+    dnsq_t *w, *next;
+    int inflight, n = 1;
+
+    q->cb(q->arg, res);
+    if (q->waiters) {
+        dns_clock(&now);
+    }
+    for (w = q->waiters; w; w = next, n++) {
+        next = w->next;
+        wres = *res;
+        wres.rtt = (now.tv_sec - w->queued.tv_sec) * 1000000 + (now.tv_usec - w->queued.tv_usec);
+        w->cb(w->arg, &wres);
+        free(w);
+    }
+    free(q);
+
+    pthread_mutex_lock(&dns_lock);
+    inflight = (dns_inflight -= n);
+    if (n > 1) {
+        pthread_cond_broadcast(&dns_space);
+    } else {
+        pthread_cond_signal(&dns_space);
+    }
+    pthread_mutex_unlock(&dns_lock);
+    stats_solver_inflight(inflight);
+}
+
+
+/*
+ * An attempt to upstream i ends without its answer
+ */
+static void ns_abandon(int i) {
+    __atomic_sub_fetch(&dns_ns[i].outstanding, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * The hedge of q ends: it answered or timed out (counted), or its answer
+ * is no longer wanted
+ */
+static void hedge_end(dnsq_t *q, int counted) {
+    if (!q->hedged) {
+        return;
+    }
+    dns_ids[q->hid] = NULL;
+    q->hedged = 0;
+    if (!counted) {
+        ns_abandon(q->hns);
+    }
+}
+
+
+/*
+ * Query is done: release its IDs and timer
+ */
+static void dns_complete(dnsq_t *q, dnsresult_t *res) {
+    struct timeval now;
+
+    dns_ids[q->id] = NULL;
+    hedge_end(q, 0);
+    tmo_unlink(q);
+    dns_pending_unlink(q);
+    dns_clock(&now);
+    res->rtt = (now.tv_sec - q->started.tv_sec) * 1000000 + (now.tv_usec - q->started.tv_usec);
+    stats_solver_time(&q->started, &now);
+    dns_finish(q, res);
+}
+
+
+static void dns_fail(dnsq_t *q, dnsstatus_t status) {
+    dnsresult_t res;
+
+    memset(&res, 0, sizeof(res));
+    res.status = status;
+    dns_complete(q, &res);
+}
+
+
+/*
+ * "address:port" of upstream u, in buf
+ */
+static char *ns_name(const upstream_t *u, char *buf, int size) {
+    char addr[INET_ADDRSTRLEN];
+
+    inet_ntop(AF_INET, &u->addr.sin_addr, addr, sizeof(addr));
+    snprintf(buf, size, "%s:%d", addr, ntohs(u->addr.sin_port));
+    return buf;
+}
+
+
+/*
+ * What an attempt to upstream i is expected to cost
+ */
+static unsigned long ns_cost(int i) {
+    return (unsigned long) (dns_ns[i].ewma + 1) * (dns_ns[i].outstanding + 1);
+}
+
+
+/*
+ * Upstream for the next attempt: the cheaper of two picked at random
+ * (power of two choices). Ejected upstreams and exclude, the one just
+ * tried, are left out while there are others.
+ */
+static int ns_pick(int exclude) {
+    int cand[DNS_MAXNS];
+    long now;
+    int n = 0, i, a, b;
+
+    if (dns_nns == 1) {
+        return 0;
+    }
+    now = dns_msec();
+    for (i = 0; i < dns_nns; i++) {
+        if (i != exclude && dns_ns[i].ejected <= now) {
+            cand[n++] = i;
+        }
+    }
+    if (n == 0) {
+        for (i = 0; i < dns_nns; i++) {
+            if (i != exclude) {
+                cand[n++] = i;
+            }
+        }
+    }
+    if (n == 1) {
+        return cand[0];
+    }
+    a = dns_random() % n;
+    b = (a + 1 + dns_random() % (n - 1)) % n;
+    return ns_cost(cand[a]) <= ns_cost(cand[b]) ? cand[a] : cand[b];
+}
+
+
+/*
+ * Add an attempt time to upstream u's average
+ */
+static void ns_sample(upstream_t *u, unsigned long us) {
+    long ewma = u->ewma;
+
+    ewma = ewma ? ewma + (((long) us - ewma) >> NS_EWMA_SHIFT) : (long) us;
+    __atomic_store_n(&u->ewma, (unsigned int) ewma, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * An attempt to upstream u failed. An upstream failing again and again
+ * is ejected for a while; once back, one more failure before a good
+ * answer ejects it again.
+ */
+static void ns_failed(upstream_t *u, long now, const char *why) {
+    char name[32];
+
+    if (++u->fails >= NS_EJECT_FAILS && dns_nns > 1 && u->ejected <= now) {
+        __atomic_store_n(&u->ejected, now + NS_EJECT_MS, __ATOMIC_RELAXED);
+        u->fails = NS_EJECT_FAILS - 1;
+        CTR_ADD(u->ctr, NS_EJECTED, 1);
+        syslog(LOG_NOTICE, "Nameserver %s %s, left out for %d s", ns_name(u, name, sizeof(name)), why, NS_EJECT_MS / 1000);
+    }
+}
+
+
+/*
+ * An attempt sent to upstream i at sent got an answer, or SERVFAIL. A
+ * SERVFAIL is a failure: quick as it may be, it does not make the
+ * upstream look any cheaper.
+ */
+static void ns_answered(int i, const struct timeval *sent, int servfail) {
+    upstream_t *u = &dns_ns[i];
+    struct timeval now;
+    unsigned long us;
+    char name[32];
+
+    dns_clock(&now);
+    us = (now.tv_sec - sent->tv_sec) * 1000000 + (now.tv_usec - sent->tv_usec);
+    HIST_ADD(u->ctr, NS_RTT, us);
+    __atomic_sub_fetch(&u->outstanding, 1, __ATOMIC_RELAXED);
+    if (servfail) {
+        CTR_ADD(u->ctr, NS_SERVFAILS, 1);
+        ns_failed(u, dns_msec(), "failing");
+        return;
+    }
+    ns_sample(u, us);
+    CTR_ADD(u->ctr, NS_ANSWERS, 1);
+    u->fails = 0;
+    if (u->ejected) {
+        syslog(LOG_NOTICE, "Nameserver %s answering again", ns_name(u, name, sizeof(name)));
+        __atomic_store_n(&u->ejected, 0, __ATOMIC_RELAXED);
+    }
+}
+
+
+/*
+ * An attempt sent to upstream i timed out after tmo ms
+ */
+static void ns_timedout(int i, int tmo, long now) {
+    upstream_t *u = &dns_ns[i];
+
+    ns_sample(u, tmo * 1000UL);
+    CTR_ADD(u->ctr, NS_TIMEOUTS, 1);
+    __atomic_sub_fetch(&u->outstanding, 1, __ATOMIC_RELAXED);
+    ns_failed(u, now, "not answering");
+}
+
+
+/*
+ * Send (or resend) q to its current upstream
+ */
+static void dns_send(dnsq_t *q) {
+    upstream_t *u = &dns_ns[q->ns];
+    ssize_t ret;
+    int failed;
+
+    q->pkt[0] = q->id >> 8;
+    q->pkt[1] = q->id & 0xff;
+    CTR_ADD(u->ctr, NS_SENT, 1);
+    __atomic_add_fetch(&u->outstanding, 1, __ATOMIC_RELAXED);
+    ret = sendto(dns_socks[q->sock], q->pkt, q->pktlen, 0, (struct sockaddr *) &u->addr, sizeof(struct sockaddr_in));
+    if ((failed = ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        dbg("sendto(): %s", strerror(errno));
+    }
+    /*
+     * A lost packet is handled like a lost answer: by the timeout, which
+     * passes at once if sending failed
+     */
+    dns_clock(&q->sent);
+    if (q->tries++ == 0) {
+        q->started = q->sent;
+    } else {
+        /* Only first attempts are hedged */
+        q->hedge_at = 0;
+    }
+    q->expires = dns_msec() + (failed ? 0 : q->tmo);
+    tmo_insert(q);
+}
+
+
+/*
+ * The first attempt of q is slower than most answers of its zone: send
+ * a copy to another upstream, if the budget allows. The first answer
+ * is taken.
+ */
+static void dns_hedge(dnsq_t *q) {
+    upstream_t *u;
+    ssize_t ret;
+    int failed;
+
+    if (hedge_credit < 100 || (q->hns = ns_pick(q->ns)) == q->ns) {
+        return;
+    }
+    hedge_credit -= 100;
+    do {
+        q->hid = dns_random();
+    } while (dns_ids[q->hid]);
+    dns_ids[q->hid] = q;
+    q->hedged = 1;
+    u = &dns_ns[q->hns];
+    q->pkt[0] = q->hid >> 8;
+    q->pkt[1] = q->hid & 0xff;
+    CTR_ADD(u->ctr, NS_SENT, 1);
+    __atomic_add_fetch(&u->outstanding, 1, __ATOMIC_RELAXED);
+    ret = sendto(dns_socks[q->sock], q->pkt, q->pktlen, 0, (struct sockaddr *) &u->addr, sizeof(struct sockaddr_in));
+    if ((failed = ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        dbg("sendto(): %s", strerror(errno));
+    }
+    dns_clock(&q->hsent);
+    q->hexpires = dns_msec() + (failed ? 0 : q->tmo);
+    stats_solver_hedge(0);
+}
+
+
+/*
+ * Take over a freshly submitted query: if the same question has been
+ * sent already, wait for that answer. Otherwise assign ID and socket,
+ * and send it.
+ */
+static void dns_start(dnsq_t *q) {
+    struct timeval now;
+    dnsq_t *p;
+    unsigned int h = 2166136261U;
+    int i;
+
+    for (i = 12; i < 12 + q->qlen; i++) {
+        h = (h ^ q->pkt[i]) * 16777619U;
+    }
+    q->hash = h;
+    if ((p = dns_pending_find(q)) != NULL) {
+        q->next = p->waiters;
+        p->waiters = q;
+        stats_solver_lookup(1);
+        return;
+    }
+    q->hnext = dns_pending[h & (DNS_PENDING - 1)];
+    dns_pending[h & (DNS_PENDING - 1)] = q;
+    stats_solver_lookup(0);
+    do {
+        q->id = dns_random();
+    } while (dns_ids[q->id]);
+    dns_ids[q->id] = q;
+    q->sock = dns_nextsock++ % dns_nsock;
+    q->ns = ns_pick(-1);
+    q->tries = 0;
+    /* Every query adds to the hedge budget */
+    if (hedge_credit < 100 * DNS_HEDGE_BURST) {
+        hedge_credit += DNS_HEDGE_PCT;
+    }
+    if (q->hedge > 0 && dns_nns > 1) {
+        q->hedge_at = dns_msec() + q->hedge;
+    }
+    dns_clock(&now);
+    stats_solver_wait(&q->queued, &now);
+    dns_send(q);
+}
+
+
+static void dns_recv(int idx) {
+    unsigned char pkt[DNS_MAXPKT];
+    struct sockaddr_in from;
+    socklen_t fromlen;
+    dnsresult_t res;
+    dnsq_t *q;
+    ssize_t len;
+    int ret, hedge, ns;
+
+    while (1) {
+        fromlen = sizeof(from);
+        len = recvfrom(dns_socks[idx], pkt, sizeof(pkt), 0, (struct sockaddr *) &from, &fromlen);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                dbg("recvfrom(): %s", strerror(errno));
+            }
+            return;
+        }
+        if (len < 12) {
+            continue;
+        }
+        if ((q = dns_ids[GET16(pkt)]) == NULL || q->sock != idx) {
+            continue;
+        }
+        hedge = q->hedged && GET16(pkt) == q->hid;
+        ns = hedge ? q->hns : q->ns;
+        if (from.sin_addr.s_addr != dns_ns[ns].addr.sin_addr.s_addr
+            || from.sin_port != dns_ns[ns].addr.sin_port) {
+            /* late, spoofed or unrelated */
+            continue;
+        }
+        ret = dns_parse(q, pkt, len, &res);
+        if (ret < 0) {
+            continue;
+        }
+        ns_answered(ns, hedge ? &q->hsent : &q->sent, ret > 0);
+        if (hedge) {
+            hedge_end(q, 1);
+            if (ret == 0) {
+                /* The hedge wins, the first attempt is dropped */
+                ns_abandon(q->ns);
+                stats_solver_hedge(1);
+                dns_complete(q, &res);
+            }
+            /* A failed hedge leaves the first attempt running */
+        } else if (ret == 0) {
+            dns_complete(q, &res);
+        } else if (q->tries < DNS_ATTEMPTS) {
+            /* A hedge in flight may still answer */
+            tmo_unlink(q);
+            q->ns = ns_pick(q->ns);
+            dns_send(q);
+        } else {
+            dns_fail(q, DNS_SERVFAIL);
+        }
+    }
+}
+
+
+/*
+ * Send the hedges that are due, end those timed out, retry or fail all
+ * attempts whose deadline has passed; returns ms until the next timer
+ * (-1: none)
+ */
+static int dns_expire(void) {
+    long now = dns_msec();
+    dnsq_t *q;
+
+    while (tmo_n && (q = tmo_heap[0])->deadline <= now) {
+        tmo_unlink(q);
+        if (q->hedged && q->hexpires <= now) {
+            ns_timedout(q->hns, q->tmo, now);
+            hedge_end(q, 1);
+        }
+        if (q->expires > now) {
+            if (q->hedge_at && q->hedge_at <= now) {
+                q->hedge_at = 0;
+                dns_hedge(q);
+            }
+            tmo_insert(q);
+            continue;
+        }
+        ns_timedout(q->ns, q->tmo, now);
+        if (q->tries < DNS_ATTEMPTS) {
+            /* A hedge in flight may still answer */
+            q->ns = ns_pick(q->ns);
+            dns_send(q);
+        } else {
+            dns_fail(q, DNS_TIMEOUT);
+        }
+    }
+    return tmo_n ? (int) (tmo_heap[0]->deadline - now) : -1;
+}
+
+
+static void *dns_th(void *data) {
+    struct pollfd pfd[DNS_MAXSOCK + 1];
+    dnsresult_t res;
+    dnsq_t *q, *next;
+    char buf[64];
+    int i, timeout;
+
+    pfd[0].fd = dns_wakeup[0];
+    pfd[0].events = POLLIN;
+    for (i = 0; i < dns_nsock; i++) {
+        pfd[i + 1].fd = dns_socks[i];
+        pfd[i + 1].events = POLLIN;
+    }
+    timeout = -1;
+    while (!dns_stop) {
+        if (poll(pfd, dns_nsock + 1, timeout) < 0 && errno != EINTR) {
+            syslog(LOG_ERR, "poll(): %s", strerror(errno));
+            break;
+        }
+        if (pfd[0].revents & POLLIN) {
+            while (read(dns_wakeup[0], buf, sizeof(buf)) > 0);
+            pthread_mutex_lock(&dns_lock);
+            q = submit_head;
+            submit_head = submit_tail = NULL;
+            pthread_mutex_unlock(&dns_lock);
+            for (; q; q = next) {
+                next = q->next;
+                dns_start(q);
+            }
+        }
+        for (i = 0; i < dns_nsock; i++) {
+            if (pfd[i + 1].revents & POLLIN) {
+                dns_recv(i);
+            }
+        }
+        timeout = dns_expire();
+    }
+
+    /* Shutdown: fail everything still pending */
+    memset(&res, 0, sizeof(res));
+    res.status = DNS_ERROR;
+    pthread_mutex_lock(&dns_lock);
+    q = submit_head;
+    submit_head = submit_tail = NULL;
+    pthread_mutex_unlock(&dns_lock);
+    for (; q; q = next) {
+        next = q->next;
+        dns_finish(q, &res);
+    }
+    while (tmo_n) {
+        dns_fail(tmo_heap[0], DNS_ERROR);
+    }
+    return NULL;
+}
+
+
+/*
+ * Queue a lookup of name's A record. Blocks while the in-flight limit
+ * is reached. cb is called exactly once if 0 is returned.
+ */
+int dns_query(const char *name, dns_cb_t cb, void *arg) {
+    unsigned char qname[DNS_MAXNAME];
+    int qlen;
+
+    if ((qlen = dns_wirename(qname, sizeof(qname), name)) < 0) {
+        syslog(LOG_NOTICE, "Can not encode query name '%s'", name);
+        return -1;
+    }
+    return dns_query_wire(qname, qlen, 0, 0, cb, arg);
+}
+
+
+/*
+ * Like dns_query(), for a name already in wire format. Each attempt
+ * times out after tmo ms, 0 for the default. Without an answer hedge ms
+ * after the first attempt, a copy may go to another upstream; 0 = never.
+ */
+int dns_query_wire(const unsigned char *qname, int qlen, int tmo, int hedge, dns_cb_t cb, void *arg) {
+    dnsq_t *q;
+    int wake, inflight;
+
+    if ((q = malloc(sizeof(dnsq_t))) == NULL) {
+        return -1;
+    }
+    memset(q, 0, sizeof(dnsq_t));
+    dns_encode(q, qname, qlen);
+    q->tmo = tmo > 0 ? tmo : DNS_ATTEMPT_MS;
+    q->hedge = hedge;
+    q->tslot = -1;
+    q->cb = cb;
+    q->arg = arg;
+
+    pthread_mutex_lock(&dns_lock);
+    while (dns_inflight >= dns_cap && !dns_stop) {
+        pthread_cond_wait(&dns_space, &dns_lock);
+    }
+    if (dns_stop) {
+        pthread_mutex_unlock(&dns_lock);
+        free(q);
+        return -1;
+    }
+    inflight = ++dns_inflight;
+    dns_clock(&q->queued);
+    wake = (submit_head == NULL);
+    if (submit_tail) {
+        submit_tail->next = q;
+    } else {
+        submit_head = q;
+    }
+    submit_tail = q;
+    pthread_mutex_unlock(&dns_lock);
+    if (wake) {
+        write(dns_wakeup[1], "", 1);
+    }
+    stats_solver_inflight(inflight);
+    return 0;
+}
+
+
+/*
+ * Open nsockets UDP sockets and start the event thread
+ */
+int dns_init(nsitem_t *nameservers, int nsockets, int maxinflight) {
+    struct sockaddr_in sin;
+    nsitem_t *ns;
+    int i, err;
+
+    memset(dns_ns, 0, sizeof(dns_ns));
+    memset(ns_seen, 0, sizeof(ns_seen));
+    for (dns_nns = 0, ns = nameservers; ns && dns_nns < DNS_MAXNS; ns = ns->next) {
+        dns_ns[dns_nns++].addr = ns->addr;
+    }
+    if (dns_nns == 0) {
+        dns_parse_ns("127.0.0.1", &dns_ns[dns_nns++].addr);
+    }
+    for (i = 0; i < dns_nns; i++) {
+        dbg("Using nameserver %s:%d", inet_ntoa(dns_ns[i].addr.sin_addr), ntohs(dns_ns[i].addr.sin_port));
+    }
+    if (nsockets < 1) {
+        nsockets = 1;
+    } else if (nsockets > DNS_MAXSOCK) {
+        nsockets = DNS_MAXSOCK;
+    }
+    /* Leave plenty of free IDs for the random picker */
+    dns_cap = maxinflight > 32768 ? 32768 : maxinflight;
+    dns_seed();
+    /* At most one timer per query in flight */
+    if ((tmo_heap = malloc((dns_cap + 1) * sizeof(dnsq_t *))) == NULL) {
+        return -1;
+    }
+    tmo_n = 0;
+
+    if (pipe(dns_wakeup) != 0) {
+        syslog(LOG_ERR, "pipe(): %s", strerror(errno));
+        return -1;
+    }
+    fcntl(dns_wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(dns_wakeup[1], F_SETFL, O_NONBLOCK);
+    for (dns_nsock = 0; dns_nsock < nsockets; dns_nsock++) {
+        if ((dns_socks[dns_nsock] = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+            syslog(LOG_ERR, "Can not create DNS socket: %s", strerror(errno));
+            break;
+        }
+        /* bind to a random port for every socket */
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        bind(dns_socks[dns_nsock], (struct sockaddr *) &sin, sizeof(sin));
+        fcntl(dns_socks[dns_nsock], F_SETFL, O_NONBLOCK);
+    }
+    if (dns_nsock == 0) {
+        return -1;
+    }
+    dns_stop = 0;
+    if ((err = pthread_create(&dns_tid, NULL, dns_th, NULL)) != 0) {
+        syslog(LOG_ERR, "Failed to create DNS thread: %s", strerror(err));
+        return -1;
+    }
+    stats_solver_thr(dns_nsock);
+    dbg("DNS engine started: %d sockets, %d nameservers, %d lookups in flight max", dns_nsock, dns_nns, dns_cap);
+    return 0;
+}
+
+
+/*
+ * Stop the event thread; lookups still pending complete with DNS_ERROR
+ */
+void dns_shutdown(void) {
+    int i;
+
+    if (dns_nsock == 0) {
+        return;
+    }
+    pthread_mutex_lock(&dns_lock);
+    dns_stop = 1;
+    pthread_cond_broadcast(&dns_space);
+    pthread_mutex_unlock(&dns_lock);
+    write(dns_wakeup[1], "", 1);
+    pthread_join(dns_tid, NULL);
+    for (i = 0; i < dns_nsock; i++) {
+        close(dns_socks[i]);
+    }
+    dns_nsock = 0;
+    close(dns_wakeup[0]);
+    close(dns_wakeup[1]);
+    free(tmo_heap);
+    tmo_heap = NULL;
+}
+
+
+/*
+ * Log the counters of each upstream, and its attempt times since the
+ * previous call. Called from one thread at a time.
+ */
+void dns_log_stats(void) {
+    upstream_t *u;
+    ctr_t h[HIST_BUCKETS];
+    char name[32], buf[64];
+    int i, b;
+
+    for (i = 0; i < dns_nns; i++) {
+        u = &dns_ns[i];
+        for (b = 0; b < HIST_BUCKETS; b++) {
+            h[b] = CTR_GET(u->ctr, NS_RTT + b) - ns_seen[i][b];
+            ns_seen[i][b] += h[b];
+        }
+        syslog(LOG_INFO, "Nameserver %s%s: %lu queries, %lu answers, %lu SERVFAIL, %lu timeouts, ejected %lu times; "
+               "%d outstanding, %0.1f ms avg; answer ms p50/p95/p99/max %s",
+               ns_name(u, name, sizeof(name)), __atomic_load_n(&u->ejected, __ATOMIC_RELAXED) > dns_msec() ? " (ejected)" : "",
+               CTR_GET(u->ctr, NS_SENT), CTR_GET(u->ctr, NS_ANSWERS), CTR_GET(u->ctr, NS_SERVFAILS),
+               CTR_GET(u->ctr, NS_TIMEOUTS), CTR_GET(u->ctr, NS_EJECTED),
+               __atomic_load_n(&u->outstanding, __ATOMIC_RELAXED), __atomic_load_n(&u->ewma, __ATOMIC_RELAXED) / 1000.0,
+               hist_format(buf, sizeof(buf), h));
+    }
+}
@@ -0,0 +1,84 @@
+/*
+   rblpolicyd - a policy daemon for Postfix (http://www.postfix.org/),
+   which allows combining different RBLs with weights.
+
+   $Id$
+   Public asynchronous DNS interface
+
+   Copyright (C) 2004 Thomas Lamy
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#ifndef __DNS_H
+#define __DNS_H
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define DNS_MAXNAME    256     /* max. length of a query name */
+#define DNS_MAXPKT     512     /* plain UDP DNS */
+#define DNS_MAXNS      8       /* max. number of upstream resolvers */
+
+/* Outcome of a lookup */
+typedef enum {
+    DNS_LISTED = 0,    /* A record in 127.0.0.0/8 */
+    DNS_NOTLISTED,     /* NXDOMAIN, NODATA or a non-127 answer */
+    DNS_SERVFAIL,      /* upstream could not answer */
+    DNS_TIMEOUT,       /* no answer from any upstream */
+    DNS_ERROR          /* malformed name, local failure or shutdown */
+} dnsstatus_t;
+
+/*
+ * Lookup result, passed to the completion callback.
+ * addr is the first A record in network byte order (0 if none),
+ * ttl is the answer TTL, or the negative caching TTL from the SOA.
+ */
+typedef struct {
+    dnsstatus_t status;
+    unsigned int addr;
+    unsigned int ttl;
+    unsigned int rtt;      /* us between sending and answer */
+} dnsresult_t;
+
+/*
+ * Completion callback. Runs on the DNS event thread, so it must not
+ * block and must not call dns_query().
+ */
+typedef void (*dns_cb_t)(void *arg, const dnsresult_t *res);
+
+int dns_init(nsitem_t *nameservers, int nsockets, int maxinflight);
+
+void dns_shutdown(void);
+
+int dns_query(const char *name, dns_cb_t cb, void *arg);
+
+int dns_query_wire(const unsigned char *qname, int qlen, int tmo, int hedge, dns_cb_t cb, void *arg);
+
+int dns_wirename(unsigned char *buf, int size, const char *name);
+
+int dns_rblname(unsigned char *buf, unsigned int ip, const unsigned char *suffix, int suffixlen);
+
+int dns_read_resolvconf(const char *filename, nsitem_t **list);
+
+int dns_parse_ns(const char *str, struct sockaddr_in *sin);
+
+const char *dns_status(dnsstatus_t status);
+
+void dns_log_stats(void);
+
+#endif
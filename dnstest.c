@@ -0,0 +1,416 @@
+/*
+   rblpolicyd - a policy daemon for Postfix (http://www.postfix.org/),
+   which allows combining different RBLs with weights.
+
+   $Id$
+   Offline test of the DNS client against a local stub server
+
+   Copyright (C) 2004 Thomas Lamy
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <time.h>
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <pthread.h>
+
+#include "system.h"
+
+#include "cfgfile.h"
+#include "dns.h"
+#include "stats.h"
+
+/*
+ * The stub server answers by the zone, the last two labels of the name:
+ *   listed.test    A 127.0.0.2, TTL 300
+ *   nx.test        NXDOMAIN, SOA minimum 120
+ *   mismatch.test  a LISTED answer with a wrong ID, then NXDOMAIN
+ *   retry.test     drops the first query, answers the second one
+ *   servfail.test  SERVFAIL
+ *   dead.test      never answers
+ *   hedge.test     drops the first query, answers the second one after
+ *                  HEDGE_DELAY ms, drops the rest
+ *   bigttl.test    A 127.0.0.2, TTL 2^31 + 300
+ * A second, broken stub answers SERVFAIL to everything.
+ */
+enum { Z_LISTED, Z_NX, Z_MISMATCH, Z_RETRY, Z_SERVFAIL, Z_DEAD, Z_HEDGE, Z_BIGTTL, Z_UNKNOWN };
+
+static const char *zones[] = {
+    "listed.test", "nx.test", "mismatch.test", "retry.test", "servfail.test", "dead.test", "hedge.test",
+    "bigttl.test"
+};
+
+#define HEDGE_DELAY    300
+
+static int stub_fd[2];                  /* the stub, the broken one */
+static volatile int stub_stop = 0;
+static int stub_seen[Z_UNKNOWN + 1];    /* queries received per zone */
+static int broken_seen = 0;             /* queries received by the broken stub */
+
+typedef struct {
+    const char *name;
+    dnsstatus_t want;
+    unsigned int ttl;      /* expected TTL, 0 = don't care */
+    int queries;           /* expected queries at the stub, 0 = don't care */
+    int tmo;               /* ms per attempt, 0 = default */
+    int maxms;             /* must be done within, 0 = don't care */
+    int hedge;             /* ms until hedged, 0 = never */
+    int done;
+    long ms;               /* taken until done */
+    dnsresult_t res;
+} testcase_t;
+
+static long started;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+
+/*
+ * Zone of the question in pkt; *qend is set to the end of the question
+ */
+static int stub_zone(const unsigned char *pkt, int len, int *qend) {
+    char name[DNS_MAXNAME];
+    int off = 12, n = 0, dots[2] = { -1, -1 }, z;
+
+    while (off < len && pkt[off] && n + pkt[off] + 1 < (int) sizeof(name)) {
+        if (n) {
+            dots[0] = dots[1];
+            dots[1] = n;
+            name[n++] = '.';
+        }
+        memcpy(name + n, pkt + off + 1, pkt[off]);
+        n += pkt[off];
+        off += pkt[off] + 1;
+    }
+    name[n] = '\0';
+    *qend = off + 5;
+    if (off >= len || *qend > len) {
+        return Z_UNKNOWN;
+    }
+    for (z = 0; z < Z_UNKNOWN; z++) {
+        if (strcmp(name + dots[0] + 1, zones[z]) == 0) {
+            return z;
+        }
+    }
+    return Z_UNKNOWN;
+}
+
+
+/*
+ * Answer q: listed with a TTL of ttl, or NXDOMAIN/SERVFAIL by rcode
+ */
+static void stub_reply(int fd, const struct sockaddr_in *to, const unsigned char *q, int qend,
+                       unsigned int id, int rcode, int listed, unsigned int ttl) {
+    static const unsigned char a[] = {
+        0xc0, 0x0c, 0, 1, 0, 1, 0, 0, 1, 0x2c, 0, 4, 127, 0, 0, 2
+    };
+    /* SOA: root names, serial 1, refresh, retry, expire, minimum 120 */
+    static const unsigned char soa[] = {
+        0xc0, 0x0c, 0, 6, 0, 1, 0, 0, 0x0e, 0x10, 0, 22, 0, 0,
+        0, 0, 0, 1, 0, 0, 0x0e, 0x10, 0, 0, 0x02, 0x58, 0, 1, 0x51, 0x80, 0, 0, 0, 120
+    };
+    unsigned char pkt[DNS_MAXPKT];
+    int len;
+
+    memcpy(pkt, q, qend);
+    pkt[0] = id >> 8;
+    pkt[1] = id & 0xff;
+    pkt[2] = 0x81;
+    pkt[3] = 0x80 | rcode;
+    memset(pkt + 6, 0, 6);
+    len = qend;
+    if (listed) {
+        pkt[7] = 1;
+        memcpy(pkt + len, a, sizeof(a));
+        pkt[len + 6] = ttl >> 24;
+        pkt[len + 7] = ttl >> 16;
+        pkt[len + 8] = ttl >> 8;
+        pkt[len + 9] = ttl;
+        len += sizeof(a);
+    } else if (rcode == 3) {
+        pkt[9] = 1;
+        memcpy(pkt + len, soa, sizeof(soa));
+        len += sizeof(soa);
+    }
+    sendto(fd, pkt, len, 0, (const struct sockaddr *) to, sizeof(*to));
+}
+
+
+static void *stub_th(void *data) {
+    unsigned char pkt[DNS_MAXPKT];
+    struct sockaddr_in from;
+    struct pollfd pfd[2];
+    socklen_t fromlen;
+    unsigned int id;
+    int fd, len, qend, z;
+
+    pfd[0].fd = stub_fd[0];
+    pfd[1].fd = stub_fd[1];
+    pfd[0].events = pfd[1].events = POLLIN;
+    while (!stub_stop) {
+        if (poll(pfd, 2, 100) <= 0) {
+            continue;
+        }
+        fd = pfd[0].revents & POLLIN ? stub_fd[0] : stub_fd[1];
+        fromlen = sizeof(from);
+        if ((len = recvfrom(fd, pkt, sizeof(pkt), 0, (struct sockaddr *) &from, &fromlen)) < 12) {
+            continue;
+        }
+        z = stub_zone(pkt, len, &qend);
+        id = (unsigned int) pkt[0] << 8 | pkt[1];
+        pthread_mutex_lock(&lock);
+        if (fd == stub_fd[1]) {
+            broken_seen++;
+            pthread_mutex_unlock(&lock);
+            stub_reply(fd, &from, pkt, qend, id, 2, 0, 0);
+            continue;
+        }
+        stub_seen[z]++;
+        pthread_mutex_unlock(&lock);
+        switch (z) {
+            case Z_LISTED:
+                stub_reply(fd, &from, pkt, qend, id, 0, 1, 300);
+                break;
+            case Z_MISMATCH:
+                stub_reply(fd, &from, pkt, qend, id ^ 0x5a5a, 0, 1, 300);
+                /* fall through */
+            case Z_NX:
+                stub_reply(fd, &from, pkt, qend, id, 3, 0, 0);
+                break;
+            case Z_RETRY:
+                if (stub_seen[z] > 1) {
+                    stub_reply(fd, &from, pkt, qend, id, 0, 1, 300);
+                }
+                break;
+            case Z_SERVFAIL:
+                stub_reply(fd, &from, pkt, qend, id, 2, 0, 0);
+                break;
+            case Z_BIGTTL:
+                stub_reply(fd, &from, pkt, qend, id, 0, 1, 0x80000000 + 300);
+                break;
+            case Z_HEDGE:
+                if (stub_seen[z] == 2) {
+                    poll(NULL, 0, HEDGE_DELAY);
+                    stub_reply(fd, &from, pkt, qend, id, 0, 1, 300);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return NULL;
+}
+
+
+static long msec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+
+static void test_done(void *arg, const dnsresult_t *res) {
+    testcase_t *t = arg;
+
+    pthread_mutex_lock(&lock);
+    t->ms = msec() - started;
+    t->res = *res;
+    t->done = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ * Look up all names of tests at once and wait for them, at most secs
+ */
+static int run(testcase_t *tests, int n, int secs) {
+    unsigned char qname[DNS_MAXNAME];
+    struct timespec until;
+    int i, qlen, failed = 0;
+
+    started = msec();
+    for (i = 0; i < n; i++) {
+        qlen = dns_wirename(qname, sizeof(qname), tests[i].name);
+        if (dns_query_wire(qname, qlen, tests[i].tmo, tests[i].hedge, test_done, &tests[i]) != 0) {
+            tests[i].done = -1;
+        }
+    }
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += secs;
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < n; i++) {
+        while (tests[i].done == 0 && pthread_cond_timedwait(&cond, &lock, &until) == 0);
+    }
+    for (i = 0; i < n; i++) {
+        testcase_t *t = &tests[i];
+        int z, seen;
+
+        for (z = 0; z < Z_UNKNOWN && !strstr(t->name, zones[z]); z++);
+        seen = stub_seen[z];
+        if (t->done != 1) {
+            printf("FAIL %s: %s\n", t->name, t->done ? "not queued" : "no result");
+        } else if (t->res.status != t->want) {
+            printf("FAIL %s: %s (%d), expected %s\n", t->name, dns_status(t->res.status), t->res.status, dns_status(t->want));
+        } else if (t->ttl && t->res.ttl != t->ttl) {
+            printf("FAIL %s: TTL %u, expected %u\n", t->name, t->res.ttl, t->ttl);
+        } else if (t->queries && seen != t->queries) {
+            printf("FAIL %s: %d queries, expected %d\n", t->name, seen, t->queries);
+        } else if (t->maxms && t->ms > t->maxms) {
+            printf("FAIL %s: done after %ld ms, expected %d at most\n", t->name, t->ms, t->maxms);
+        } else {
+            printf("ok   %s: %s\n", t->name, dns_status(t->res.status));
+            continue;
+        }
+        failed++;
+    }
+    pthread_mutex_unlock(&lock);
+    return failed;
+}
+
+
+int main(int argc, char **argv) {
+    testcase_t quick[] = {
+        { "2.0.0.127.listed.test", DNS_LISTED, 300, 1 },
+        { "1.0.0.127.nx.test", DNS_NOTLISTED, 120, 1 },
+        { "2.0.0.127.mismatch.test", DNS_NOTLISTED, 120, 1 },
+        { "2.0.0.127.bigttl.test", DNS_LISTED, 0, 1 },     /* TTL 0, checked below */
+    };
+    /*
+     * Lookups time out together: each must end with DNS_TIMEOUT, the one
+     * with the short timeout first
+     */
+    testcase_t slow[] = {
+        { "2.0.0.127.retry.test", DNS_LISTED, 300, 2 },
+        { "2.0.0.127.servfail.test", DNS_SERVFAIL, 0, 3 },
+        { "1.0.0.127.dead.test", DNS_TIMEOUT, 0, 0 },
+        { "2.0.0.127.dead.test", DNS_TIMEOUT, 0, 0 },
+        { "3.0.0.127.dead.test", DNS_TIMEOUT, 0, 9, 100, 600 },    /* all three, 3 attempts each */
+    };
+    /*
+     * The hedge budget fills with 20 lookups. The hedge is sent 200 ms
+     * into the first attempt and answers 100 ms into the retry: its
+     * answer must still be taken.
+     */
+    testcase_t hedged[21];
+    /*
+     * With the broken stub as another upstream, all lookups must still
+     * be answered. Its SERVFAILs eject it in the first 20, then it gets
+     * no more queries.
+     */
+    testcase_t ejected[40];
+    char names[60][32];
+    struct sockaddr_in sin[2];
+    socklen_t sinlen;
+    nsitem_t ns[2];
+    pthread_t tid;
+    int i, seen, failed;
+
+    for (i = 0; i < 2; i++) {
+        if ((stub_fd[i] = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+            perror("socket");
+            return 1;
+        }
+        memset(&sin[i], 0, sizeof(sin[i]));
+        sin[i].sin_family = AF_INET;
+        sin[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sinlen = sizeof(sin[i]);
+        if (bind(stub_fd[i], (struct sockaddr *) &sin[i], sizeof(sin[i])) != 0
+            || getsockname(stub_fd[i], (struct sockaddr *) &sin[i], &sinlen) != 0) {
+            perror("bind");
+            return 1;
+        }
+    }
+    pthread_create(&tid, NULL, stub_th, NULL);
+
+    memset(hedged, 0, sizeof(hedged));
+    for (i = 0; i < 20; i++) {
+        snprintf(names[i], sizeof(names[i]), "%d.1.0.127.listed.test", i);
+        hedged[i].name = names[i];
+        hedged[i].want = DNS_LISTED;
+    }
+    hedged[20].name = "2.0.0.127.hedge.test";
+    hedged[20].want = DNS_LISTED;
+    hedged[20].tmo = 400;
+    hedged[20].hedge = 200;
+    hedged[20].maxms = 600;
+    memset(ejected, 0, sizeof(ejected));
+    for (i = 0; i < 40; i++) {
+        snprintf(names[20 + i], sizeof(names[20 + i]), "%d.2.0.127.listed.test", i);
+        ejected[i].name = names[20 + i];
+        ejected[i].want = DNS_LISTED;
+    }
+
+    /* Hedges need two upstreams: the stub, twice */
+    memset(ns, 0, sizeof(ns));
+    ns[0].addr = ns[1].addr = sin[0];
+    ns[0].next = &ns[1];
+    if (dns_init(ns, 2, 64) != 0) {
+        printf("FAIL dns_init\n");
+        return 1;
+    }
+    failed = run(quick, sizeof(quick) / sizeof(quick[0]), 5);
+    if (quick[3].res.ttl != 0) {
+        printf("FAIL %s: TTL %u, expected 0\n", quick[3].name, quick[3].res.ttl);
+        failed++;
+    }
+    failed += run(hedged, sizeof(hedged) / sizeof(hedged[0]), 5);
+    failed += run(slow, sizeof(slow) / sizeof(slow[0]), 10);
+    dns_shutdown();
+
+    ns[1].addr = sin[1];
+    if (dns_init(ns, 2, 64) != 0) {
+        printf("FAIL dns_init\n");
+        return 1;
+    }
+    failed += run(ejected, 20, 5);
+    pthread_mutex_lock(&lock);
+    seen = broken_seen;
+    pthread_mutex_unlock(&lock);
+    failed += run(ejected + 20, 20, 5);
+    pthread_mutex_lock(&lock);
+    if (seen < 5 || broken_seen != seen) {
+        printf("FAIL broken upstream: %d queries before, %d after, expected it ejected\n", seen, broken_seen - seen);
+        failed++;
+    } else {
+        printf("ok   broken upstream: ejected after %d queries\n", seen);
+    }
+    pthread_mutex_unlock(&lock);
+    dns_shutdown();
+
+    stub_stop = 1;
+    pthread_join(tid, NULL);
+    close(stub_fd[0]);
+    close(stub_fd[1]);
+    return failed ? 1 : 0;
+}
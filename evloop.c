@@ -0,0 +1,564 @@
+/*
+   rblpolicyd - a policy daemon for Postfix (http://www.postfix.org/),
+   which allows combining different RBLs with weights.
+
+   $Id$
+   epoll based connection handling
+
+   Copyright (C) 2004 Thomas Lamy
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+/*
+ * A single event thread owns the listening socket and all client
+ * connections. Requests are collected as bytes arrive; only complete
+ * requests are handed to the worker pool. Workers pass the reply back
+ * through a completion list and an eventfd, the event thread sends it
+ * and waits for the next request on the same connection, as Postfix
+ * keeps policy connections open.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE    /* accept4() */
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "system.h"
+
+#include "cfgfile.h"
+#include "request.h"
+#include "evloop.h"
+#include "thrmgr.h"
+#include "worker.h"
+#include "counters.h"
+#include "reload.h"
+#include "stats.h"
+#include "globals.h"
+#include "xmalloc.h"
+
+#define EV_EVENTS    256
+#define EV_CHUNK     1024
+
+static int ev_fd = -1;        /* epoll instance */
+static int ev_wake = -1;      /* eventfd, signalled by ev_reply() */
+static int ev_sig = -1;       /* signalfd for SIGHUP and SIGUSR1 */
+static int ev_lsock = -1;
+
+/*
+ * Connections waiting for the client, oldest activity first. Clients in
+ * the middle of a request or reply get EV_TIMEOUT seconds, those between
+ * requests get the idle timeout.
+ */
+typedef struct connlist {
+    conn_t *head;
+    conn_t *tail;
+} connlist_t;
+
+static connlist_t busy = {NULL, NULL};
+static connlist_t idle = {NULL, NULL};
+
+/* Replies handed back by the workers */
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static conn_t *done_list = NULL;
+
+/* Tags for the fds that are not connections */
+static char tag_listen, tag_wake, tag_signal;
+
+
+static unsigned int ev_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned int) ts.tv_sec;
+}
+
+
+static void tmo_unlink(conn_t *c) {
+    connlist_t *l = c->tmo;
+
+    if (!l) {
+        return;
+    }
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        l->head = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    } else {
+        l->tail = c->prev;
+    }
+    c->next = c->prev = NULL;
+    c->tmo = NULL;
+}
+
+
+/* (Re)append c to a timeout list, it has just been active */
+static void tmo_touch(conn_t *c, connlist_t *l) {
+    tmo_unlink(c);
+    c->active = ev_now();
+    c->prev = l->tail;
+    if (l->tail) {
+        l->tail->next = c;
+    } else {
+        l->head = c;
+    }
+    l->tail = c;
+    c->tmo = l;
+}
+
+
+/* Watch c for events, or stop watching it if events is 0 */
+static int conn_watch(conn_t *c, unsigned int events) {
+    struct epoll_event ev;
+    int ret;
+
+    if (!events) {
+        if (!c->watched) {
+            return 0;
+        }
+        c->watched = 0;
+        return epoll_ctl(ev_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    }
+    ev.events = events;
+    ev.data.ptr = c;
+    ret = epoll_ctl(ev_fd, c->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, &ev);
+    if (ret == 0) {
+        c->watched = 1;
+    } else {
+        syslog(LOG_ERR, "epoll_ctl(): %s", strerror(errno));
+    }
+    return ret;
+}
+
+
+static void conn_close(conn_t *c) {
+    tmo_unlink(c);
+    stats_connection(c->requests);
+    close(c->fd);
+    if (c->buf) {
+        free(c->buf);
+    }
+    if (c->reply) {
+        free(c->reply);
+    }
+    free(c);
+}
+
+
+/*
+ * Send as much of the reply as the socket takes. Returns 1 when done,
+ * 0 if the rest has to wait for EPOLLOUT, -1 on error.
+ */
+static int conn_write(conn_t *c) {
+    int ret;
+
+    while (c->sent < c->replen) {
+        ret = write(c->fd, c->reply + c->sent, c->replen - c->sent);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            dbg("Could not write reply: %s", strerror(errno));
+            return -1;
+        }
+        c->sent += ret;
+    }
+    return 1;
+}
+
+
+/*
+ * The request in c->buf is complete: stop watching the socket and hand
+ * it to a worker. Returns -1 if the connection has been closed.
+ */
+static int conn_dispatch(conn_t *c) {
+    int ret;
+
+    tmo_unlink(c);
+    conn_watch(c, 0);
+    c->state = CONN_BUSY;
+    stats_clock(&c->received);
+    if (maxthreads == 0) {
+        worker_th(c);
+        return 0;
+    }
+    if ((ret = wpool_submit(c)) == 0) {
+        return 0;
+    }
+    if (ret == -ERR_THR_QFULL) {
+        stats_overload();
+        if (overload == OVERLOAD_DUNNO) {
+            ev_reply(c, xstrdup("action=DUNNO\n\n"), 14);
+            return 0;
+        }
+    } else {
+        syslog(LOG_NOTICE, "Could not queue request: %s", thr_error(-ret));
+    }
+    conn_close(c);
+    return -1;
+}
+
+
+/*
+ * Feed the bytes read since the last call to the request parser.
+ * Returns 1 if a complete request has been dispatched.
+ */
+static int conn_parse(conn_t *c) {
+    int done;
+
+    done = req_feed(&c->req, c->buf, c->scan, c->len);
+    c->scan = c->len;
+    if (!done) {
+        return 0;
+    }
+    conn_dispatch(c);
+    return 1;
+}
+
+
+/*
+ * Read what is available and dispatch the request once it's complete.
+ * Returns -1 if the connection is to be closed.
+ */
+static int conn_read(conn_t *c) {
+    int ret;
+
+    while (1) {
+        if (c->size - c->len < EV_CHUNK) {
+            if (c->size >= EV_MAXREQUEST) {
+                syslog(LOG_NOTICE, "Request exceeds %d bytes, closing connection", EV_MAXREQUEST);
+                return -1;
+            }
+            c->size = c->size ? c->size * 2 : EV_CHUNK * 2;
+            if (c->size > EV_MAXREQUEST) {
+                c->size = EV_MAXREQUEST;
+            }
+            c->buf = xrealloc(c->buf, c->size);
+        }
+        ret = read(c->fd, c->buf + c->len, c->size - c->len - 1);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            dbg("Could not read from socket: %s", strerror(errno));
+            return -1;
+        }
+        if (ret == 0) {
+            /* Client is done sending; answer what we've got, if anything */
+            if (c->len == 0) {
+                return -1;
+            }
+            /* Terminate the last line and the request */
+            c->buf[c->len++] = '\n';
+            c->buf[c->len++] = '\n';
+            c->buf[c->len] = '\0';
+            conn_parse(c);
+            return 0;
+        }
+        c->len += ret;
+        if (conn_parse(c)) {
+            return 0;
+        }
+    }
+    tmo_touch(c, c->len ? &busy : &idle);
+    return 0;
+}
+
+
+/*
+ * The reply has been sent: drop the request from the buffer, keeping
+ * anything the client has sent after it, and wait for the next one.
+ * Returns -1 if the connection is to be closed.
+ */
+static int conn_next(conn_t *c) {
+    c->requests++;
+    free(c->reply);
+    c->reply = NULL;
+    c->len -= c->req.end;
+    memmove(c->buf, c->buf + c->req.end, c->len);
+    req_reset(&c->req);
+    c->scan = 0;
+    c->state = CONN_READ;
+    if (c->len && conn_parse(c)) {
+        return 0;
+    }
+    if (conn_watch(c, EPOLLIN | EPOLLRDHUP) != 0) {
+        return -1;
+    }
+    tmo_touch(c, c->len ? &busy : &idle);
+    return 0;
+}
+
+
+static void ev_accept(void) {
+    conn_t *c;
+    int fd;
+
+    while ((fd = accept4(ev_lsock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        c = xmalloc(sizeof(conn_t));
+        memset(c, 0, sizeof(conn_t));
+        c->fd = fd;
+        c->state = CONN_READ;
+        req_reset(&c->req);
+        if (conn_watch(c, EPOLLIN | EPOLLRDHUP) != 0) {
+            conn_close(c);
+            continue;
+        }
+        tmo_touch(c, &idle);
+        dbg("Accepted connection; conn=%d", fd);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        syslog(LOG_ERR, "accept() failure: %s", strerror(errno));
+    }
+}
+
+
+/*
+ * Send the replies the workers have finished. Whatever doesn't fit into
+ * the socket buffer is sent on EPOLLOUT.
+ */
+static void ev_completed(void) {
+    conn_t *c, *next;
+    uint64_t cnt;
+    int ret;
+
+    if (read(ev_wake, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+        syslog(LOG_NOTICE, "eventfd read(): %s", strerror(errno));
+    }
+    pthread_mutex_lock(&done_lock);
+    c = done_list;
+    done_list = NULL;
+    pthread_mutex_unlock(&done_lock);
+    for (; c; c = next) {
+        next = c->next;
+        c->next = NULL;
+        c->state = CONN_WRITE;
+        if ((ret = conn_write(c)) == 1) {
+            ret = conn_next(c);
+        } else if (ret == 0) {
+            ret = conn_watch(c, EPOLLOUT);
+            tmo_touch(c, &busy);
+        }
+        if (ret < 0) {
+            conn_close(c);
+        }
+    }
+}
+
+
+/*
+ * Close connections that have been quiet for too long
+ */
+static void ev_expire(void) {
+    unsigned int now = ev_now();
+    conn_t *c;
+
+    while ((c = busy.head) != NULL && now - c->active >= EV_TIMEOUT) {
+        syslog(LOG_NOTICE, "Timeout on connection %d (%d bytes read)", c->fd, c->len);
+        conn_close(c);
+    }
+    while ((c = idle.head) != NULL && now - c->active >= (unsigned int) idletimeout) {
+        dbg("Closing idle connection %d after %d requests", c->fd, c->requests);
+        conn_close(c);
+    }
+}
+
+
+/*
+ * Hand the reply for c back to the event thread. Takes ownership of
+ * reply, which must be malloc()ed. Callable from any thread.
+ */
+void ev_reply(conn_t *c, char *reply, int len) {
+    uint64_t one = 1;
+
+    c->reply = reply;
+    c->replen = len;
+    c->sent = 0;
+    pthread_mutex_lock(&done_lock);
+    c->next = done_list;
+    done_list = c;
+    pthread_mutex_unlock(&done_lock);
+    if (write(ev_wake, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        syslog(LOG_NOTICE, "eventfd write(): %s", strerror(errno));
+    }
+}
+
+
+int ev_init(int lsock) {
+    struct epoll_event ev;
+    sigset_t mask;
+    int flags;
+
+    if ((ev_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        syslog(LOG_ERR, "epoll_create1(): %s", strerror(errno));
+        return -1;
+    }
+    if ((ev_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        syslog(LOG_ERR, "eventfd(): %s", strerror(errno));
+        close(ev_fd);
+        return -1;
+    }
+    ev_lsock = lsock;
+    flags = fcntl(lsock, F_GETFL, 0);
+    fcntl(lsock, F_SETFL, flags | O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &tag_listen;
+    epoll_ctl(ev_fd, EPOLL_CTL_ADD, lsock, &ev);
+    ev.data.ptr = &tag_wake;
+    epoll_ctl(ev_fd, EPOLL_CTL_ADD, ev_wake, &ev);
+    /* SIGHUP and SIGUSR1 are blocked in all threads and read from here */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+    if ((ev_sig = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        syslog(LOG_NOTICE, "signalfd(): %s; SIGHUP and SIGUSR1 disabled", strerror(errno));
+    } else {
+        ev.data.ptr = &tag_signal;
+        epoll_ctl(ev_fd, EPOLL_CTL_ADD, ev_sig, &ev);
+    }
+    return 0;
+}
+
+
+/*
+ * Signals taken by the event loop. SIGHUP starts a reload, which runs
+ * on a thread of its own while requests keep being served. SIGUSR1
+ * logs the statistics.
+ */
+static void ev_signal(void) {
+    struct signalfd_siginfo si;
+
+    while (read(ev_sig, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGHUP) {
+            reload_start();
+        } else if (si.ssi_signo == SIGUSR1) {
+            stats_log();
+        }
+    }
+}
+
+
+/*
+ * Serve connections until appstate leaves APP_RUN.
+ * Returns -1 on fatal errors.
+ */
+int ev_run(void) {
+    struct epoll_event events[EV_EVENTS];
+    conn_t *c;
+    int n, i, ret;
+
+    while (appstate == APP_RUN) {
+        n = epoll_wait(ev_fd, events, EV_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "epoll_wait(): %s", strerror(errno));
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == &tag_listen) {
+                ev_accept();
+                continue;
+            }
+            if (events[i].data.ptr == &tag_wake) {
+                ev_completed();
+                continue;
+            }
+            if (events[i].data.ptr == &tag_signal) {
+                ev_signal();
+                continue;
+            }
+            c = events[i].data.ptr;
+            if (c->state == CONN_WRITE) {
+                ret = conn_write(c);
+                if (ret == 1) {
+                    ret = conn_next(c);
+                } else if (ret == 0) {
+                    tmo_touch(c, &busy);
+                }
+            } else {
+                ret = conn_read(c);
+            }
+            if (ret < 0) {
+                conn_close(c);
+            }
+        }
+        ev_expire();
+    }
+    return 0;
+}
+
+
+/*
+ * Close all connections. The workers must be stopped already.
+ */
+void ev_free(void) {
+    conn_t *c;
+
+    if (ev_fd < 0) {
+        return;
+    }
+    while ((c = busy.head) != NULL) {
+        conn_close(c);
+    }
+    while ((c = idle.head) != NULL) {
+        conn_close(c);
+    }
+    while ((c = done_list) != NULL) {
+        done_list = c->next;
+        c->next = NULL;
+        conn_close(c);
+    }
+    if (ev_sig >= 0) {
+        close(ev_sig);
+    }
+    close(ev_wake);
+    close(ev_fd);
+    ev_sig = ev_wake = ev_fd = -1;
+}
@@ -0,0 +1,77 @@
+/*
+   rblpolicyd - a policy daemon for Postfix (http://www.postfix.org/),
+   which allows combining different RBLs with weights.
+
+   $Id$
+   epoll based connection handling
+
+   Copyright (C) 2004 Thomas Lamy
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#ifndef __EVLOOP_H
+#define __EVLOOP_H
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define EV_MAXREQUEST  65536   /* max. size of a single policy request */
+#define EV_TIMEOUT     10      /* seconds to wait within a request */
+
+struct connlist;
+
+typedef enum {
+    CONN_READ = 0,     /* collecting a request */
+    CONN_BUSY,         /* request handed to a worker */
+    CONN_WRITE         /* sending the reply */
+} connstate_t;
+
+/*
+ * A client connection, which may carry any number of requests one after
+ * the other. Owned by the event loop, except while CONN_BUSY,
+ * when the worker may read the request and hands it back by ev_reply().
+ */
+typedef struct conn {
+    int fd;
+    connstate_t state;
+    char *buf;             /* request(s) as read */
+    int len;
+    int size;
+    int scan;              /* parsed up to here */
+    request_t req;         /* attributes of the current request */
+    char *reply;
+    int replen;
+    int sent;
+    int requests;          /* requests answered on this connection */
+    char watched;          /* registered with epoll */
+    unsigned int active;   /* time of last activity, for timeouts */
+    struct timeval received;    /* current request complete, stats_clock() */
+    struct connlist *tmo;  /* timeout list c is on */
+    struct conn *next;     /* timeout list, or completed replies */
+    struct conn *prev;
+} conn_t;
+
+int ev_init(int lsock);
+
+int ev_run(void);
+
+void ev_free(void);
+
+void ev_reply(conn_t *c, char *reply, int len);
+
+#endif
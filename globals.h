@@ -11,6 +11,12 @@ typedef enum {
     APP_ERROR
 } appstate_t;
 
+/* What to do with a connection when the worker queue is full */
+typedef enum {
+    OVERLOAD_DUNNO = 0,    /* answer DUNNO right away */
+    OVERLOAD_CLOSE        /* just close the connection */
+} overload_t;
+
 __EXTERN__ char *progname;
 __EXTERN__ char *cfgpath;
 __EXTERN__ char verbose;
@@ -18,7 +24,21 @@ __EXTERN__ char debug;
 __EXTERN__ char foreground;
 __EXTERN__ appstate_t appstate;
 __EXTERN__ int maxthreads;
-__EXTERN__ cfgitem_t *rblist;
-
-__EXTERN__ pthread_mutex_t rblist_mutex;
+__EXTERN__ int queuedepth;
+__EXTERN__ overload_t overload;
+__EXTERN__ int dnssockets;
+__EXTERN__ int maxinflight;
+__EXTERN__ int cachesize;
+__EXTERN__ int verdictsize;
+__EXTERN__ int negttl;
+__EXTERN__ int posttl;
+__EXTERN__ char planner;
+__EXTERN__ int idletimeout;
+__EXTERN__ int sessionsize;
+__EXTERN__ char speculate;
+__EXTERN__ int deadline;
+__EXTERN__ int probeinterval;
+__EXTERN__ int hedgeweight;
+__EXTERN__ cfgitem_t *rblist;    /* as read at startup, published by server() */
+__EXTERN__ nsitem_t *nslist;
 
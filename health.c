@@ -0,0 +1,451 @@
+/*
+   rblpolicyd - a policy daemon for Postfix (http://www.postfix.org/),
+   which allows combining different RBLs with weights.
+
+   $Id$
+   Zone health: a circuit breaker per zone, sidelining dead zones
+
+   Copyright (C) 2004 Thomas Lamy
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+
+#include <stdio.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <pthread.h>
+#include <time.h>
+
+#include "system.h"
+
+#include "cfgfile.h"
+#include "dns.h"
+#include "cache.h"
+#include "counters.h"
+#include "reload.h"
+#include "health.h"
+#include "globals.h"
+#include "xmalloc.h"
+
+/*
+ * Every zone of a list has a circuit breaker:
+ *
+ * - closed: the zone is asked. Its circuit opens when too many of its
+ *   lookups time out or fail, when it seems to list everything (then it
+ *   is probed right away), or when a probe fails.
+ * - open: requests leave the zone out. After the backoff, it moves to
+ * - half-open: still left out while it is probed. A good probe closes
+ *   the circuit again, anything else opens it for twice as long.
+ *
+ * A probe looks up the RFC 5782 test entries: 127.0.0.2 must be listed,
+ * 127.0.0.1 must not be. Its answer times go into the zone's histogram
+ * like those of real lookups. A zone listing 127.0.0.1 probably lists
+ * everything, the prober thread drops its cached answers: that walks
+ * the whole cache, too slow for the DNS thread.
+ *
+ * The prober thread probes open zones once their backoff is over, and
+ * with -T every zone every probeinterval seconds. Zones start half-open
+ * then: a new list is only published once its zones are probed.
+ *
+ * health_check() runs from cfg_rates(), once a second under the set's
+ * ratelock; probe answers come in on the DNS thread. Each transition is
+ * a compare and swap of the state, done by whoever gets there first.
+ */
+
+/* Counters as of the last judgement, HEALTH_SLOTS per zone */
+#define HS_ANSWERS     0
+#define HS_TIMEOUTS    1
+#define HS_SERVFAILS   2
+#define HS_QUESTIONS   3
+#define HS_POSITIVE    4
+
+#define PROBE_LISTED   0x7f000002      /* 127.0.0.2 */
+#define PROBE_CLEAN    0x7f000001      /* 127.0.0.1 */
+
+/* Lookups of one probe, status[] indexed like tests[] */
+typedef struct {
+    cfgset_t *set;
+    int zone;
+    unsigned int pending;  /* lookups outstanding */
+    dnsstatus_t status[2];
+    unsigned int rtt;      /* us, slowest answer */
+} probe_t;
+
+static const unsigned int tests[2] = { PROBE_LISTED, PROBE_CLEAN };
+
+static const char *states[] = { "closed", "open", "half-open" };
+
+static pthread_t health_tid;
+static int health_running = 0;
+static int health_stopping = 0;
+static pthread_mutex_t health_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t health_wake;
+
+
+/*
+ * Open the circuit of zone z if it is in state from. Reopening after a
+ * failed probe doubles the backoff, unless it was the zone's first one.
+ * why NULL logs nothing. Returns non-zero if the circuit was opened.
+ */
+static int health_open(cfgset_t *set, int z, unsigned int from, const char *why) {
+    unsigned int backoff = __atomic_load_n(&set->backoff[z], __ATOMIC_RELAXED);
+
+    if (from == ZONE_HALFOPEN && why && __atomic_load_n(&set->reopen[z], __ATOMIC_RELAXED)) {
+        backoff = backoff * 2 > ZONE_CB_BACKOFF_MAX ? ZONE_CB_BACKOFF_MAX : backoff * 2;
+        __atomic_store_n(&set->backoff[z], backoff, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&set->reopen[z], cache_now() + backoff, __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&set->health[z], &from, ZONE_OPEN, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    if (why) {
+        CTR_ADD(ctr_local(set->stats), ZS_OPENED(set->zones->nzones, z), 1);
+        syslog(LOG_NOTICE, "Zone %s disabled for %u s: %s", ZONE_NAME(set->zones, z), backoff, why);
+    }
+    return 1;
+}
+
+
+/*
+ * Both lookups of probe p are done: close or open the circuit
+ */
+static void health_judge(probe_t *p) {
+    cfgset_t *set = p->set;
+    int z = p->zone;
+    unsigned int from = __atomic_load_n(&set->health[z], __ATOMIC_ACQUIRE);
+    dnsstatus_t listed = p->status[0];
+    dnsstatus_t clean = p->status[1];
+    char why[64];
+
+    if (listed == DNS_LISTED && clean == DNS_NOTLISTED) {
+        if (from == ZONE_HALFOPEN
+            && __atomic_compare_exchange_n(&set->health[z], &from, ZONE_CLOSED, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&set->backoff[z], ZONE_CB_BACKOFF, __ATOMIC_RELAXED);
+            syslog(LOG_NOTICE, "Zone %s enabled, test entries answered in %u ms", ZONE_NAME(set->zones, z), p->rtt / 1000);
+        } else {
+            dbg("Zone %s ok, test entries answered in %u ms", ZONE_NAME(set->zones, z), p->rtt / 1000);
+        }
+        return;
+    }
+    if (from == ZONE_OPEN) {
+        return;
+    }
+    if (listed == DNS_ERROR || clean == DNS_ERROR) {
+        /* Not the zone's fault; try again after the same backoff */
+        health_open(set, z, ZONE_HALFOPEN, NULL);
+    } else if (clean == DNS_LISTED) {
+        if (health_open(set, z, from, "127.0.0.1 is listed, so probably everything is")) {
+            /* Its answers so far are worthless */
+            __atomic_store_n(&set->flush[z], 1, __ATOMIC_RELEASE);
+        }
+    } else if (listed == DNS_NOTLISTED && clean == DNS_NOTLISTED) {
+        health_open(set, z, from, "127.0.0.2 is not listed");
+    } else {
+        snprintf(why, sizeof(why), "probe %s", dns_status(listed != DNS_LISTED ? listed : clean));
+        health_open(set, z, from, why);
+    }
+}
+
+
+/*
+ * One lookup of a probe is done. Runs on the DNS event thread, or in
+ * health_probe() if the lookup could not be started.
+ */
+static void health_probed(probe_t *p, int i, const dnsresult_t *res) {
+    cfgset_t *set = p->set;
+
+    p->status[i] = res->status;
+    if (res->status == DNS_LISTED || res->status == DNS_NOTLISTED || res->status == DNS_SERVFAIL) {
+        HIST_ADD(ctr_local(set->stats), ZS_RTT(set->zones->nzones, p->zone), res->rtt);
+        if (res->rtt > p->rtt) {
+            p->rtt = res->rtt;
+        }
+    }
+    if (__atomic_sub_fetch(&p->pending, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    health_judge(p);
+    __atomic_store_n(&set->probing[p->zone], 0, __ATOMIC_RELEASE);
+    free(p);
+    cfg_release(set);
+}
+
+
+static void health_listed_cb(void *data, const dnsresult_t *res) {
+    health_probed(data, 0, res);
+}
+
+
+static void health_clean_cb(void *data, const dnsresult_t *res) {
+    health_probed(data, 1, res);
+}
+
+
+/*
+ * Look up the test entries in zone z in the background, unless a probe
+ * is already in flight. It holds a reference to set.
+ */
+static void health_probe(cfgset_t *set, int z) {
+    static const dns_cb_t cbs[2] = { health_listed_cb, health_clean_cb };
+    zonetab_t *tab = set->zones;
+    unsigned char qname[DNS_MAXNAME];
+    dnsresult_t err;
+    probe_t *p;
+    int i, qlen;
+
+    if (__atomic_exchange_n(&set->probing[z], 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    p = xcalloc(1, sizeof(probe_t));
+    p->set = set;
+    p->zone = z;
+    p->pending = 2;
+    cfg_hold(set);
+    memset(&err, 0, sizeof(err));
+    err.status = DNS_ERROR;
+    for (i = 0; i < 2; i++) {
+        qlen = dns_rblname(qname, tests[i], ZONE_QSUFFIX(tab, z), tab->qsuffixlen[z]);
+        if (qlen < 0 || dns_query_wire(qname, qlen, ZONE_TMO_MAX, 0, cbs[i], p) != 0) {
+            health_probed(p, i, &err);
+        }
+    }
+}
+
+
+/*
+ * Judge zone z by its counters since the last judgement; answers is the
+ * number of answers it gave so far. Caller holds set->ratelock.
+ */
+void health_check(cfgset_t *set, int z, ctr_t answers) {
+    int n = set->zones->nzones;
+    ctr_t *seen = set->healthseen + z * HEALTH_SLOTS;
+    ctr_t cur[HEALTH_SLOTS];
+    unsigned long long lookups, q;
+    char why[64];
+
+    cur[HS_ANSWERS] = answers;
+    cur[HS_TIMEOUTS] = ctr_sum(set->stats, ZS_TIMEOUTS(n, z));
+    cur[HS_SERVFAILS] = ctr_sum(set->stats, ZS_SERVFAILS(n, z));
+    cur[HS_QUESTIONS] = ctr_sum(set->stats, ZS_QUESTIONS(n, z));
+    cur[HS_POSITIVE] = ctr_sum(set->stats, ZS_POSITIVE(n, z));
+    if (!ZONE_USABLE(set, z)) {
+        /* Once closed again, the zone is judged from scratch */
+        memcpy(seen, cur, sizeof(cur));
+        return;
+    }
+    /* SERVFAILs are answers too */
+    lookups = cur[HS_ANSWERS] - seen[HS_ANSWERS] + cur[HS_TIMEOUTS] - seen[HS_TIMEOUTS];
+    if (lookups >= ZONE_CB_SAMPLES) {
+        why[0] = '\0';
+        if ((cur[HS_TIMEOUTS] - seen[HS_TIMEOUTS]) * 100 >= ZONE_CB_FAILPCT * lookups) {
+            snprintf(why, sizeof(why), "%llu of %llu lookups timed out",
+                     (unsigned long long) (cur[HS_TIMEOUTS] - seen[HS_TIMEOUTS]), lookups);
+        } else if ((cur[HS_SERVFAILS] - seen[HS_SERVFAILS]) * 100 >= ZONE_CB_FAILPCT * lookups) {
+            snprintf(why, sizeof(why), "%llu of %llu lookups failed",
+                     (unsigned long long) (cur[HS_SERVFAILS] - seen[HS_SERVFAILS]), lookups);
+        }
+        seen[HS_ANSWERS] = cur[HS_ANSWERS];
+        seen[HS_TIMEOUTS] = cur[HS_TIMEOUTS];
+        seen[HS_SERVFAILS] = cur[HS_SERVFAILS];
+        if (why[0]) {
+            health_open(set, z, ZONE_CLOSED, why);
+            return;
+        }
+    }
+    q = cur[HS_QUESTIONS] - seen[HS_QUESTIONS];
+    if (q >= ZONE_CB_QUESTIONS) {
+        if ((cur[HS_POSITIVE] - seen[HS_POSITIVE]) * 100 >= ZONE_CB_LISTPCT * q) {
+            dbg("Zone %s listed %llu of %llu addresses, probing", ZONE_NAME(set->zones, z),
+                (unsigned long long) (cur[HS_POSITIVE] - seen[HS_POSITIVE]), q);
+            health_probe(set, z);
+        }
+        seen[HS_QUESTIONS] = cur[HS_QUESTIONS];
+        seen[HS_POSITIVE] = cur[HS_POSITIVE];
+    }
+}
+
+
+/*
+ * Zone z of a new list was zone i of old: it keeps its circuit. A probe
+ * in flight reports to old, so the new list probes again right away.
+ */
+void health_carry(cfgset_t *old, int i, cfgset_t *set, int z) {
+    unsigned int state = __atomic_load_n(&old->health[i], __ATOMIC_ACQUIRE);
+
+    set->backoff[z] = __atomic_load_n(&old->backoff[i], __ATOMIC_RELAXED);
+    set->reopen[z] = __atomic_load_n(&old->reopen[i], __ATOMIC_RELAXED);
+    set->flush[z] = __atomic_load_n(&old->flush[i], __ATOMIC_ACQUIRE);
+    if (state == ZONE_HALFOPEN) {
+        state = ZONE_OPEN;
+        set->reopen[z] = 0;
+    }
+    set->health[z] = state;
+    memcpy(set->healthseen + z * HEALTH_SLOTS, old->healthseen + i * HEALTH_SLOTS, HEALTH_SLOTS * sizeof(ctr_t));
+}
+
+
+/*
+ * Probe the half-open zones of set, before it is published, and wait
+ * for the results. Returns the number of zones enabled, -1 if we're
+ * shutting down meanwhile.
+ */
+int health_gate(cfgset_t *set) {
+    struct timespec ts = { 0, 10000000 };    /* 10 ms */
+    int n = set->zones->nzones;
+    int z, busy, enabled;
+
+    for (z = 0; z < n; z++) {
+        if (__atomic_load_n(&set->health[z], __ATOMIC_RELAXED) == ZONE_HALFOPEN) {
+            health_probe(set, z);
+        }
+    }
+    /* Every probe ends, with a timeout at the latest */
+    do {
+        if (appstate == APP_EXIT || appstate == APP_ERROR) {
+            return -1;
+        }
+        for (z = 0, busy = 0; z < n; z++) {
+            busy |= __atomic_load_n(&set->probing[z], __ATOMIC_ACQUIRE);
+        }
+        if (busy) {
+            nanosleep(&ts, NULL);
+        }
+    } while (busy);
+    for (z = 0, enabled = 0; z < n; z++) {
+        enabled += ZONE_USABLE(set, z);
+    }
+    return enabled;
+}
+
+
+/*
+ * Once a second: drop the cached answers of zones marked for it, probe
+ * open zones whose backoff is over, and every probeinterval seconds the
+ * closed ones
+ */
+static void *health_th(void *data) {
+    struct timespec until;
+    cfgset_t *set;
+    unsigned int now, last = cache_now();
+    unsigned int state;
+    int z, all;
+
+    pthread_mutex_lock(&health_lock);
+    while (!health_stopping) {
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_sec++;
+        pthread_cond_timedwait(&health_wake, &health_lock, &until);
+        if (health_stopping) {
+            break;
+        }
+        pthread_mutex_unlock(&health_lock);
+        set = cfg_enter();
+        cfg_hold(set);
+        cfg_leave();
+        now = cache_now();
+        all = probeinterval > 0 && now - last >= (unsigned int) probeinterval;
+        if (all) {
+            last = now;
+        }
+        for (z = 0; z < set->zones->nzones; z++) {
+            if (__atomic_exchange_n(&set->flush[z], 0, __ATOMIC_ACQ_REL) && !cfg_stale(set)) {
+                cache_drop_zone(set->zones->index[z]);
+                vcache_flush();
+            }
+            state = __atomic_load_n(&set->health[z], __ATOMIC_ACQUIRE);
+            if (state == ZONE_OPEN && now >= __atomic_load_n(&set->reopen[z], __ATOMIC_RELAXED)
+                && __atomic_compare_exchange_n(&set->health[z], &state, ZONE_HALFOPEN, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                dbg("Zone %s half-open, probing", ZONE_NAME(set->zones, z));
+                health_probe(set, z);
+            } else if (state == ZONE_CLOSED && all) {
+                health_probe(set, z);
+            }
+        }
+        cfg_release(set);
+        pthread_mutex_lock(&health_lock);
+    }
+    pthread_mutex_unlock(&health_lock);
+    return NULL;
+}
+
+
+/*
+ * Probe the zones of the list published at startup, then start the
+ * prober thread. Called before requests are accepted.
+ */
+int health_start(void) {
+    pthread_condattr_t attr;
+    cfgset_t *set;
+    int enabled;
+
+    set = cfg_enter();
+    cfg_hold(set);
+    cfg_leave();
+    if (probeinterval > 0) {
+        syslog(LOG_INFO, "Probing %d zones", set->zones->nzones);
+        enabled = health_gate(set);
+        if (enabled >= 0) {
+            syslog(LOG_INFO, "%d of %d zones enabled", enabled, set->zones->nzones);
+        }
+    }
+    cfg_release(set);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&health_wake, &attr);
+    pthread_condattr_destroy(&attr);
+    health_stopping = 0;
+    if (pthread_create(&health_tid, NULL, health_th, NULL) != 0) {
+        syslog(LOG_ERR, "Could not start prober thread");
+        pthread_cond_destroy(&health_wake);
+        return -1;
+    }
+    health_running = 1;
+    return 0;
+}
+
+
+/*
+ * Stop the prober thread; probes in flight end with the DNS engine
+ */
+void health_stop(void) {
+    if (!health_running) {
+        return;
+    }
+    pthread_mutex_lock(&health_lock);
+    health_stopping = 1;
+    pthread_cond_signal(&health_wake);
+    pthread_mutex_unlock(&health_lock);
+    pthread_join(health_tid, NULL);
+    pthread_cond_destroy(&health_wake);
+    health_running = 0;
+}
+
+
+const char *health_state(cfgset_t *set, int z) {
+    return states[__atomic_load_n(&set->health[z], __ATOMIC_RELAXED)];
+}
@@ -0,0 +1,67 @@
+/*
+   rblpolicyd - a policy daemon for Postfix (http://www.postfix.org/),
+   which allows combining different RBLs with weights.
+
+   $Id$
+   Public zone health (circuit breaker) interface
+
+   Copyright (C) 2004 Thomas Lamy
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#ifndef __HEALTH_H
+#define __HEALTH_H
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* Circuit breaker states; only closed zones are asked */
+#define ZONE_CLOSED        0
+#define ZONE_OPEN          1       /* sidelined until reopen */
+#define ZONE_HALFOPEN      2       /* sidelined, probe in flight */
+
+/*
+ * A zone's circuit opens when at least ZONE_CB_FAILPCT percent of
+ * ZONE_CB_SAMPLES lookups timed out, or answered SERVFAIL. A zone
+ * listing ZONE_CB_LISTPCT percent of ZONE_CB_QUESTIONS addresses is
+ * checked for listing everything.
+ */
+#define ZONE_CB_SAMPLES    20
+#define ZONE_CB_FAILPCT    50
+#define ZONE_CB_QUESTIONS  100
+#define ZONE_CB_LISTPCT    99
+#define ZONE_CB_BACKOFF    30      /* s until the first probe, doubled per failed one */
+#define ZONE_CB_BACKOFF_MAX 960
+
+#define HEALTH_SLOTS       5       /* counters remembered per zone */
+
+#define ZONE_USABLE(set, z)    (__atomic_load_n(&(set)->health[z], __ATOMIC_RELAXED) == ZONE_CLOSED)
+
+void health_check(cfgset_t *set, int z, ctr_t answers);
+
+void health_carry(cfgset_t *old, int i, cfgset_t *set, int z);
+
+int health_gate(cfgset_t *set);
+
+int health_start(void);
+
+void health_stop(void);
+
+const char *health_state(cfgset_t *set, int z);
+
+#endif
@@ -0,0 +1,153 @@
+/*
+   rblpolicyd - a policy daemon for Postfix (http://www.postfix.org/),
+   which allows combining different RBLs with weights.
+
+   $Id$
+   Benchmark of client address parsing and query name building
+
+   Copyright (C) 2004 Thomas Lamy
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <netinet/in.h>
+#include <time.h>
+#include <sys/time.h>
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include "system.h"
+
+#include "xmalloc.h"
+#include "cfgfile.h"
+#include "dns.h"
+#include "request.h"
+
+/*
+ * Per request, the old path parsed the client address with sscanf(),
+ * printed the reversed address into a malloc'd buffer, and for every
+ * zone printed "<reversed>.<zone>", strdup'ed it and encoded it to wire
+ * format. The new path parses with req_ipv4() and builds each wire name
+ * with dns_rblname() from the zone's prebuilt suffix.
+ */
+#define ZONES       26
+#define REQUESTS    400000
+#define ADDRESSES   4096
+
+static const char *zones[ZONES] = {
+    "zen.spamhaus.org", "bl.spamcop.net", "b.barracudacentral.org", "dnsbl.sorbs.net",
+    "cbl.abuseat.org", "psbl.surriel.com", "ix.dnsbl.manitu.net", "dnsbl-1.uceprotect.net",
+    "dnsbl-2.uceprotect.net", "dnsbl-3.uceprotect.net", "db.wpbl.info", "bl.mailspike.net",
+    "truncate.gbudb.net", "dnsbl.dronebl.org", "spam.dnsbl.anonmails.de", "all.s5h.net",
+    "bl.blocklist.de", "dnsbl.inps.de", "rbl.interserver.net", "bl.nszones.com",
+    "spam.spamrats.com", "noptr.spamrats.com", "dyna.spamrats.com", "z.mailspike.net",
+    "hostkarma.junkemailfilter.com", "bl.0spam.org"
+};
+
+static char addrs[ADDRESSES][16];
+static unsigned char suffix[ZONES][DNS_MAXNAME];
+static int suffixlen[ZONES];
+
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static unsigned long old_path(const char *client) {
+    unsigned char wire[DNS_MAXNAME];
+    char rqname[DNS_MAXNAME + 64];
+    char *rdn, *hostname;
+    int o1, o2, o3, o4;
+    unsigned long sum = 0;
+    int z;
+
+    rdn = malloc(strlen(client) + 1);
+    if (sscanf(client, "%d.%d.%d.%d", &o1, &o2, &o3, &o4) != 4) {
+        free(rdn);
+        return 0;
+    }
+    sprintf(rdn, "%d.%d.%d.%d", o4, o3, o2, o1);
+    for (z = 0; z < ZONES; z++) {
+        sprintf(rqname, "%s.%s", rdn, zones[z]);
+        hostname = xstrdup(rqname);
+        sum += dns_wirename(wire, sizeof(wire), hostname);
+        free(hostname);
+    }
+    free(rdn);
+    return sum;
+}
+
+
+static unsigned long new_path(const char *client) {
+    unsigned char wire[DNS_MAXNAME];
+    unsigned int ip;
+    unsigned long sum = 0;
+    int z;
+
+    if (req_ipv4(client, &ip) != 0) {
+        return 0;
+    }
+    for (z = 0; z < ZONES; z++) {
+        sum += dns_rblname(wire, ip, suffix[z], suffixlen[z]);
+    }
+    return sum;
+}
+
+
+int main(int argc, char **argv) {
+    unsigned long sum[2] = { 0, 0 };
+    double t0, t1, t2;
+    int requests = argc > 1 ? atoi(argv[1]) : REQUESTS;
+    int i;
+
+    for (i = 0; i < ADDRESSES; i++) {
+        sprintf(addrs[i], "%d.%d.%d.%d", 10 + i % 200, i * 7 % 256, i / 16, i % 256);
+    }
+    for (i = 0; i < ZONES; i++) {
+        suffixlen[i] = dns_wirename(suffix[i], sizeof(suffix[i]), zones[i]);
+    }
+
+    t0 = now_ns();
+    for (i = 0; i < requests; i++) {
+        sum[0] += old_path(addrs[i % ADDRESSES]);
+    }
+    t1 = now_ns();
+    for (i = 0; i < requests; i++) {
+        sum[1] += new_path(addrs[i % ADDRESSES]);
+    }
+    t2 = now_ns();
+
+    printf("%d requests, %d zones each\n", requests, ZONES);
+    printf("old: sscanf, sprintf, strdup   %8.0f ns/request\n", (t1 - t0) / requests);
+    printf("new: req_ipv4, dns_rblname     %8.0f ns/request\n", (t2 - t1) / requests);
+    if (sum[0] != sum[1]) {
+        printf("name lengths differ: %lu vs. %lu\n", sum[0], sum[1]);
+        return 1;
+    }
+    return 0;
+}
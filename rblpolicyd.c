@@ -50,6 +50,8 @@
 
 #include "server.h"
 #include "cfgfile.h"
+#include "dns.h"
+#include "cache.h"
 #include "pidfile.h"
 #include "globals.h"
 
@@ -73,6 +75,21 @@ static struct option const long_options[] = {
         {"--cfgfile",      1, NULL, 'c'},
         {"--pidfile",      1, NULL, 'p'},
         {"--max-children", 1, NULL, 'm'},
+        {"--queue-depth",  1, NULL, 'q'},
+        {"--overload",     1, NULL, 'o'},
+        {"--dns-sockets",  1, NULL, 's'},
+        {"--max-inflight", 1, NULL, 'i'},
+        {"--cache-size",   1, NULL, 'C'},
+        {"--neg-ttl",      1, NULL, 'n'},
+        {"--pos-ttl",      1, NULL, 'N'},
+        {"--verdict-cache", 1, NULL, 'K'},
+        {"--planner",      0, NULL, 'P'},
+        {"--idle-timeout", 1, NULL, 'I'},
+        {"--sessions",     1, NULL, 'S'},
+        {"--speculate",    0, NULL, 'E'},
+        {"--deadline",     1, NULL, 'D'},
+        {"--probe-interval", 1, NULL, 'T'},
+        {"--hedge",        1, NULL, 'H'},
         {"--help",         0, NULL, 'h'},
         {"--version",      0, NULL, 'V'},
         {NULL,             0, NULL, 0}
@@ -92,21 +109,34 @@ main(int argc, char **argv) {
     char *ch;
     int on = 1;
 
-    pthread_mutex_init(&rblist_mutex, NULL);
-
     cfgpath = strdup(DEFAULT_CFGFILE);
     verbose = 0;
     debug = 0;
     foreground = 0;
     appstate = APP_RUN;
     maxthreads = 10;
+    queuedepth = 256;
+    overload = OVERLOAD_DUNNO;
+    dnssockets = 4;
+    maxinflight = 1024;
+    cachesize = 16384;
+    negttl = 300;
+    posttl = 3600;
+    verdictsize = 4096;
+    planner = 0;
+    idletimeout = 300;
+    sessionsize = 4096;
+    speculate = 0;
+    deadline = 10000;
+    probeinterval = 300;
+    hedgeweight = 0;
     progname = argv[0];
 
     openlog("rbl-policyd", LOG_PID, LOG_MAIL);
 
     while (1) {
         int option_index = 0;
-        c = getopt_long(argc, argv, "vdfc:p:m:hV", long_options, &option_index);
+        c = getopt_long(argc, argv, "vdfc:p:m:q:o:s:i:C:n:N:K:PI:S:ED:T:H:hV", long_options, &option_index);
         if (c == -1)
             break;
         switch (c) {
@@ -140,6 +170,121 @@ main(int argc, char **argv) {
                 maxthreads = atoi(optarg);
                 break;
 
+            case 'q':
+                queuedepth = atoi(optarg);
+                if (queuedepth < 1) {
+                    fprintf(stderr, "%s: Invalid queue depth '%s'\n", progname, optarg);
+                    usage(pidfile, EXIT_FAILURE);
+                }
+                break;
+
+            case 'o':
+                if (strcasecmp(optarg, "dunno") == 0) {
+                    overload = OVERLOAD_DUNNO;
+                } else if (strcasecmp(optarg, "close") == 0) {
+                    overload = OVERLOAD_CLOSE;
+                } else {
+                    fprintf(stderr, "%s: Invalid overload policy '%s'\n", progname, optarg);
+                    usage(pidfile, EXIT_FAILURE);
+                }
+                break;
+
+            case 's':
+                dnssockets = atoi(optarg);
+                if (dnssockets < 1) {
+                    fprintf(stderr, "%s: Invalid number of DNS sockets '%s'\n", progname, optarg);
+                    usage(pidfile, EXIT_FAILURE);
+                }
+                break;
+
+            case 'i':
+                maxinflight = atoi(optarg);
+                if (maxinflight < 1) {
+                    fprintf(stderr, "%s: Invalid in-flight limit '%s'\n", progname, optarg);
+                    usage(pidfile, EXIT_FAILURE);
+                }
+                break;
+
+            case 'C':
+                cachesize = atoi(optarg);
+                if (cachesize < 0) {
+                    fprintf(stderr, "%s: Invalid cache size '%s'\n", progname, optarg);
+                    usage(pidfile, EXIT_FAILURE);
+                }
+                break;
+
+            case 'n':
+                negttl = atoi(optarg);
+                if (negttl < 0 || negttl > CACHE_TTL_MAX) {
+                    fprintf(stderr, "%s: Invalid negative TTL '%s'\n", progname, optarg);
+                    usage(pidfile, EXIT_FAILURE);
+                }
+                break;
+
+            case 'N':
+                posttl = atoi(optarg);
+                if (posttl < 0 || posttl > CACHE_TTL_MAX) {
+                    fprintf(stderr, "%s: Invalid positive TTL '%s'\n", progname, optarg);
+                    usage(pidfile, EXIT_FAILURE);
+                }
+                break;
+
+            case 'K':
+                verdictsize = atoi(optarg);
+                if (verdictsize < 0) {
+                    fprintf(stderr, "%s: Invalid verdict cache size '%s'\n", progname, optarg);
+                    usage(pidfile, EXIT_FAILURE);
+                }
+                break;
+
+            case 'P':
+                planner = 1;
+                break;
+
+            case 'I':
+                idletimeout = atoi(optarg);
+                if (idletimeout < 1) {
+                    fprintf(stderr, "%s: Invalid idle timeout '%s'\n", progname, optarg);
+                    usage(pidfile, EXIT_FAILURE);
+                }
+                break;
+
+            case 'S':
+                sessionsize = atoi(optarg);
+                if (sessionsize < 0) {
+                    fprintf(stderr, "%s: Invalid number of sessions '%s'\n", progname, optarg);
+                    usage(pidfile, EXIT_FAILURE);
+                }
+                break;
+
+            case 'E':
+                speculate = 1;
+                break;
+
+            case 'D':
+                deadline = atoi(optarg);
+                if (deadline < 0) {
+                    fprintf(stderr, "%s: Invalid deadline '%s'\n", progname, optarg);
+                    usage(pidfile, EXIT_FAILURE);
+                }
+                break;
+
+            case 'T':
+                probeinterval = atoi(optarg);
+                if (probeinterval < 0) {
+                    fprintf(stderr, "%s: Invalid probe interval '%s'\n", progname, optarg);
+                    usage(pidfile, EXIT_FAILURE);
+                }
+                break;
+
+            case 'H':
+                hedgeweight = atoi(optarg);
+                if (hedgeweight < 0) {
+                    fprintf(stderr, "%s: Invalid hedge weight '%s'\n", progname, optarg);
+                    usage(pidfile, EXIT_FAILURE);
+                }
+                break;
+
             case 'h':
                 usage(pidfile, 0);
                 break;  /* not reached */
@@ -169,7 +314,7 @@ main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
     dbg("Reading configuration from '%s'\n", cfgpath);
-    if ((rblist = cfg_read(cfgpath)) == NULL) {
+    if ((rblist = cfg_read(cfgpath, &nslist)) == NULL) {
         free(cfgpath);
         free(pidfile);
         cfg_free(&rblist);
@@ -177,15 +322,8 @@ main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
-
-    if ((res = res_init()) != 0) {
-        syslog(LOG_ERR, "Fatal: Cannot initialize resolver library");
-        cfg_free(&rblist);
-        free(pidfile);
-        free(cfgpath);
-        closelog();
-        exit(EXIT_FAILURE);
-        return -1;
+    if (!nslist && dns_read_resolvconf(_PATH_RESCONF, &nslist) <= 0) {
+        syslog(LOG_NOTICE, "No usable nameserver in %s, using 127.0.0.1", _PATH_RESCONF);
     }
 
     if (port[0] == '/') {
@@ -364,6 +502,7 @@ main(int argc, char **argv) {
     free(pidfile);
     closelog();
     cfg_free(&rblist);
+    cfg_free_ns(&nslist);
     return 0;
 }
 
@@ -379,11 +518,43 @@ Options:\n\
   -v, --verbose              verbose output\n\
   -d, --debug                show debug output\n\
   -f, --foreground           keep program in foreground\n\
-  -m, --maxthreads n         create up to N worker threads (0=disable threads)\n\
+  -m, --maxthreads n         run N worker threads (0=disable threads)\n\
+  -q, --queue-depth n        queue up to N connections for the workers (current: %d)\n\
+  -o, --overload POLICY      if the queue is full, answer 'dunno' or 'close'\n\
+                             the connection (current: %s)\n\
+  -s, --dns-sockets n        spread DNS queries over N UDP sockets (current: %d)\n\
+  -i, --max-inflight n       allow up to N DNS lookups in flight (current: %d)\n\
+  -C, --cache-size n         use N KB for cached DNS answers, 0=off (current: %d)\n\
+  -n, --neg-ttl n            cache negative answers for at most N seconds\n\
+                             (current: %d)\n\
+  -N, --pos-ttl n            cache listings for at most N seconds (current: %d)\n\
+  -K, --verdict-cache n      use N KB for cached verdicts per client address,\n\
+                             0=off (current: %d)\n\
+  -P, --planner              ask zones in waves, most useful first, and skip\n\
+                             those not needed for the verdict\n\
+  -I, --idle-timeout n       close client connections after N seconds without\n\
+                             a request (current: %d)\n\
+  -S, --sessions n           remember the answers of up to N SMTP sessions for\n\
+                             their further recipients, 0=off (current: %d)\n\
+  -E, --speculate            start the lookups at CONNECT/HELO/EHLO time and\n\
+                             answer DUNNO; the verdict is given at a later\n\
+                             stage of the same session\n\
+  -D, --deadline n           answer after N ms at most, with the score so far;\n\
+                             lookups still running fill the cache, 0=off\n\
+                             (current: %d)\n\
+  -T, --probe-interval n     check every zone's RFC 5782 test entries every N\n\
+                             seconds, and before it is first used; 0=off\n\
+                             (current: %d)\n\
+  -H, --hedge n              in zones of weight N or more, send a lookup to a\n\
+                             second nameserver when the first is slower than\n\
+                             the zone's p95, within 5%% extra queries; 0=off\n\
+                             (current: %d)\n\
   -c FILE, --cfgfile FILE    use config file FILE (current: %s)\n\
   -p FILE, --pidfile FILE    use file FILE to store pid (current: %s)\n\
   -h, --help                 display this help and exit\n\
   -V, --version              output version information and exit\n\
-"), cfgpath, pidfile);
+"), queuedepth, overload == OVERLOAD_CLOSE ? "close" : "dunno",
+           dnssockets, maxinflight, cachesize, negttl, posttl, verdictsize, idletimeout,
+           sessionsize, deadline, probeinterval, hedgeweight, cfgpath, pidfile);
     exit(status);
 }
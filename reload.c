@@ -0,0 +1,613 @@
+/*
+   rblpolicyd - a policy daemon for Postfix (http://www.postfix.org/),
+   which allows combining different RBLs with weights.
+
+   $Id$
+   Publishing of the zone list and reloading it on SIGHUP
+
+   Copyright (C) 2004 Thomas Lamy
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+
+#include <stdio.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <time.h>
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <pthread.h>
+
+#include "system.h"
+
+#include "cfgfile.h"
+#include "cache.h"
+#include "counters.h"
+#include "session.h"
+#include "reload.h"
+#include "health.h"
+#include "globals.h"
+#include "xmalloc.h"
+
+/*
+ * The zone list in use is published through a single pointer. Workers
+ * read it without locking; a reload builds a new list on its own thread,
+ * swaps the pointer and frees the old list after a grace period:
+ *
+ * - every thread serving a request records the generation it started
+ *   in (cfg_enter()) and clears it when done (cfg_leave()). Once all
+ *   threads have left or started after the swap, no request can pick up
+ *   the old list any more.
+ * - evaluations outliving their request (lookups still in flight,
+ *   sessions) hold a reference to the list, the old one is freed when
+ *   the last of them lets go.
+ *
+ * Zones present in both lists keep their cache index, statistics and
+ * cache entries.
+ *
+ * Statistics are counters per thread, see counters.c; the planner reads
+ * a summary that is refreshed at most once a second.
+ */
+
+/* A thread serving requests */
+typedef struct reader {
+    unsigned long gen;     /* generation seen on entry, 0 = not in a request */
+    struct reader *next;
+} __attribute__((aligned(64))) reader_t;
+
+/* What a carried over zone looked like when it was copied */
+typedef struct {
+    int from;              /* zone in the old table, -1 if new */
+    ctr_t count[ZS_COUNTERS];
+} carry_t;
+
+static cfgset_t *current = NULL;
+static unsigned long cfg_gen = 1;
+static reader_t *readers = NULL;
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread reader_t *self = NULL;
+
+static pthread_t reload_tid;
+static int reload_running = 0;     /* thread started and not joined yet */
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+static int reload_active = 0;      /* thread is still working */
+static int reload_again = 0;       /* SIGHUP during a reload */
+
+
+/*
+ * Compile list into a new set, freeing the list
+ */
+static cfgset_t *cfgset_new(cfgitem_t *list) {
+    cfgset_t *set;
+    int z;
+
+    set = xmalloc(sizeof(cfgset_t));
+    set->zones = cfg_compile(list);
+    cfg_free(&list);
+    set->stats = ctr_new(ZS_SLOTS(set->zones->nzones));
+    set->refs = 0;
+    pthread_mutex_init(&set->ratelock, NULL);
+    set->ratestamp = 0;
+    set->hitrate = xmalloc((set->zones->nzones + 1) * sizeof(unsigned int));
+    set->rtt = xcalloc(set->zones->nzones + 1, sizeof(unsigned int));
+    set->tmo = xmalloc((set->zones->nzones + 1) * sizeof(unsigned int));
+    set->hedge = xcalloc(set->zones->nzones + 1, sizeof(unsigned int));
+    set->rttseen = xcalloc(set->zones->nzones * HIST_BUCKETS + 1, sizeof(ctr_t));
+    set->tmoseen = xcalloc(set->zones->nzones * HIST_BUCKETS + 1, sizeof(ctr_t));
+    set->logseen = xcalloc(set->zones->nzones * HIST_BUCKETS + 1, sizeof(ctr_t));
+    set->health = xcalloc(set->zones->nzones + 1, sizeof(unsigned int));
+    set->reopen = xcalloc(set->zones->nzones + 1, sizeof(unsigned int));
+    set->backoff = xmalloc((set->zones->nzones + 1) * sizeof(unsigned int));
+    set->probing = xcalloc(set->zones->nzones + 1, sizeof(unsigned int));
+    set->flush = xcalloc(set->zones->nzones + 1, sizeof(unsigned int));
+    set->healthseen = xcalloc(set->zones->nzones * HEALTH_SLOTS + 1, sizeof(ctr_t));
+    for (z = 0; z < set->zones->nzones; z++) {
+        set->hitrate[z] = 1 << 15;
+        set->tmo[z] = ZONE_TMO_MAX;
+        set->backoff[z] = ZONE_CB_BACKOFF;
+        /* With the prober, zones are used once they passed a probe */
+        set->health[z] = probeinterval > 0 ? ZONE_HALFOPEN : ZONE_CLOSED;
+    }
+    return set;
+}
+
+
+static void cfgset_free(cfgset_t *set) {
+    free(set->zones);
+    ctr_free(set->stats);
+    pthread_mutex_destroy(&set->ratelock);
+    free(set->hitrate);
+    free(set->rtt);
+    free(set->tmo);
+    free(set->hedge);
+    free(set->rttseen);
+    free(set->tmoseen);
+    free(set->logseen);
+    free(set->health);
+    free(set->reopen);
+    free(set->backoff);
+    free(set->probing);
+    free(set->flush);
+    free(set->healthseen);
+    free(set);
+}
+
+
+/*
+ * Publish the list read at startup. Takes ownership of list.
+ */
+int cfg_publish_init(cfgitem_t *list) {
+    current = cfgset_new(list);
+    return 0;
+}
+
+
+/*
+ * Free the published list. The reload thread must be joined, and all
+ * evaluations released.
+ */
+void cfg_shutdown(void) {
+    reader_t *r;
+
+    if (current) {
+        if (current->refs) {
+            syslog(LOG_NOTICE, "%u evaluations still referencing the configuration", current->refs);
+        }
+        cfgset_free(current);
+        current = NULL;
+    }
+    while ((r = readers) != NULL) {
+        readers = r->next;
+        free(r);
+    }
+}
+
+
+/*
+ * Start serving a request: returns the zone list to use until
+ * cfg_leave(). Use cfg_hold() to keep it beyond that.
+ */
+cfgset_t *cfg_enter(void) {
+    reader_t *r;
+
+    if (!self) {
+        if (posix_memalign((void **) &r, 64, sizeof(reader_t)) != 0) {
+            r = xmalloc(sizeof(reader_t));
+        }
+        r->gen = 0;
+        pthread_mutex_lock(&readers_lock);
+        r->next = readers;
+        __atomic_store_n(&readers, r, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&readers_lock);
+        self = r;
+    }
+    __atomic_store_n(&self->gen, __atomic_load_n(&cfg_gen, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+}
+
+
+void cfg_leave(void) {
+    if (self) {
+        __atomic_store_n(&self->gen, 0, __ATOMIC_RELEASE);
+    }
+}
+
+
+/*
+ * Has set been replaced by a reload?
+ */
+int cfg_stale(cfgset_t *set) {
+    return set != __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+}
+
+
+void cfg_hold(cfgset_t *set) {
+    __atomic_add_fetch(&set->refs, 1, __ATOMIC_RELAXED);
+}
+
+
+void cfg_release(cfgset_t *set) {
+    __atomic_sub_fetch(&set->refs, 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Wait until every reader has left the requests it started before
+ * generation gen. Returns -1 if we're shutting down meanwhile.
+ */
+static int cfg_synchronize(unsigned long gen) {
+    struct timespec ts = { 0, 1000000 };    /* 1 ms */
+    reader_t *r;
+    unsigned long seen;
+
+    /* Readers registering from now on already see the new list */
+    for (r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+        while ((seen = __atomic_load_n(&r->gen, __ATOMIC_SEQ_CST)) != 0 && seen < gen) {
+            if (appstate == APP_EXIT || appstate == APP_ERROR) {
+                return -1;
+            }
+            nanosleep(&ts, NULL);
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Wait for the evaluations referencing set to finish
+ */
+static int cfg_drain(cfgset_t *set) {
+    struct timespec ts = { 0, 10000000 };    /* 10 ms */
+    unsigned int refs;
+    int ticks = 0;
+
+    while ((refs = __atomic_load_n(&set->refs, __ATOMIC_ACQUIRE)) != 0) {
+        if (appstate == APP_EXIT || appstate == APP_ERROR) {
+            return -1;
+        }
+        if (++ticks % 1000 == 0) {
+            syslog(LOG_NOTICE, "Reload: still waiting for %u evaluations of the old configuration", refs);
+        }
+        nanosleep(&ts, NULL);
+    }
+    return 0;
+}
+
+
+/*
+ * Give zones of list that are also in old the index they had there, and
+ * the others indices no zone of old used. Returns non-zero if zones were
+ * added or removed or weights changed.
+ */
+static int cfg_merge(cfgset_t *old, cfgitem_t *list, carry_t *carry) {
+    zonetab_t *tab = old->zones;
+    cfgitem_t *rbl;
+    char *used, *kept;
+    int maxidx = 0;
+    int nkept = 0;
+    int changed = 0;
+    int i, j, o;
+
+    for (o = 0; o < tab->nzones; o++) {
+        if (tab->index[o] > maxidx) {
+            maxidx = tab->index[o];
+        }
+    }
+    for (rbl = list; rbl; rbl = rbl->next) {
+        maxidx++;
+    }
+    used = xcalloc(maxidx + 1, 1);
+    kept = xcalloc(tab->nzones + 1, 1);
+    for (o = 0; o < tab->nzones; o++) {
+        used[tab->index[o]] = 1;
+    }
+    for (rbl = list, i = 0; rbl; rbl = rbl->next, i++) {
+        for (o = 0; o < tab->nzones; o++) {
+            /* A zone listed twice is new the second time */
+            if (!kept[o] && strcasecmp(ZONE_NAME(tab, o), rbl->rbldomain) == 0) {
+                break;
+            }
+        }
+        if (o == tab->nzones) {
+            carry[i].from = -1;
+            rbl->index = -1;
+            changed = 1;
+            continue;
+        }
+        carry[i].from = o;
+        kept[o] = 1;
+        nkept++;
+        if (tab->weight[o] != rbl->weight) {
+            changed = 1;
+        }
+        rbl->index = tab->index[o];
+    }
+    if (nkept != tab->nzones) {
+        changed = 1;
+    }
+    /* Indices of removed zones are reused by the next reload only, their
+     * cache entries are dropped once the old list is gone */
+    for (rbl = list, j = 0; rbl; rbl = rbl->next) {
+        if (rbl->index < 0) {
+            while (used[j]) {
+                j++;
+            }
+            rbl->index = j;
+            used[j] = 1;
+        }
+    }
+    free(kept);
+    free(used);
+    return changed;
+}
+
+
+/*
+ * Start the counters of zones carried over from old where they were.
+ * They go into the reload thread's own block of the new set.
+ */
+static void cfg_carry(cfgset_t *old, cfgset_t *set, carry_t *carry) {
+    int on = old->zones->nzones;
+    int n = set->zones->nzones;
+    ctr_t *v = ctr_local(set->stats);
+    int i, k, z;
+
+    for (z = 0; z < n; z++) {
+        if ((i = carry[z].from) < 0) {
+            continue;
+        }
+        for (k = 0; k < ZS_COUNTERS; k++) {
+            carry[z].count[k] = ctr_sum(old->stats, ZS_COUNT(k, on, i));
+            CTR_SET(v, ZS_COUNT(k, n, z), carry[z].count[k]);
+        }
+        /* The planner starts where it was, histograms start empty */
+        set->rtt[z] = __atomic_load_n(&old->rtt[i], __ATOMIC_RELAXED);
+        set->tmo[z] = __atomic_load_n(&old->tmo[i], __ATOMIC_RELAXED);
+        set->hedge[z] = __atomic_load_n(&old->hedge[i], __ATOMIC_RELAXED);
+        health_carry(old, i, set, z);
+    }
+}
+
+
+/*
+ * The old list is unused: add what its zones counted during the grace
+ * period, and drop the cache entries of removed zones.
+ */
+static void cfg_retire(cfgset_t *old, cfgset_t *set, carry_t *carry) {
+    int on = old->zones->nzones;
+    int n = set->zones->nzones;
+    ctr_t *v = ctr_local(set->stats);
+    int i, k, o, z;
+
+    for (z = 0; z < n; z++) {
+        if ((i = carry[z].from) < 0) {
+            continue;
+        }
+        for (k = 0; k < ZS_COUNTERS; k++) {
+            CTR_ADD(v, ZS_COUNT(k, n, z), ctr_sum(old->stats, ZS_COUNT(k, on, i)) - carry[z].count[k]);
+        }
+    }
+    for (o = 0; o < on; o++) {
+        for (z = 0; z < n && set->zones->index[z] != old->zones->index[o]; z++);
+        if (z == n) {
+            cache_drop_zone(old->zones->index[o]);
+        }
+    }
+}
+
+
+/*
+ * Refresh the planner's summary of the zone counters of set, the zone
+ * timeouts and circuit breakers, if they are older than a second and no
+ * other thread is at it already
+ */
+void cfg_rates(cfgset_t *set) {
+    unsigned int now = cache_now();
+    int n = set->zones->nzones;
+    unsigned long long q, p, cnt, answers;
+    unsigned long tmo;
+    ctr_t cur[HIST_BUCKETS], h[HIST_BUCKETS];
+    ctr_t *seen;
+    int z, i, fresh;
+
+    if (__atomic_load_n(&set->ratestamp, __ATOMIC_RELAXED) == now) {
+        return;
+    }
+    if (pthread_mutex_trylock(&set->ratelock) != 0) {
+        return;
+    }
+    if (set->ratestamp != now) {
+        for (z = 0; z < n; z++) {
+            q = ctr_sum(set->stats, ZS_QUESTIONS(n, z));
+            p = ctr_sum(set->stats, ZS_POSITIVE(n, z));
+            __atomic_store_n(&set->hitrate[z], (unsigned int) (((p + 1) << 16) / (q + 2)), __ATOMIC_RELAXED);
+            /* Median of the answers since the last refresh, if any */
+            ctr_sums(set->stats, ZS_RTT(n, z), HIST_BUCKETS, cur);
+            seen = set->rttseen + z * HIST_BUCKETS;
+            for (i = 0, fresh = 0, answers = 0; i < HIST_BUCKETS; i++) {
+                answers += cur[i];
+                fresh |= cur[i] != seen[i];
+                h[i] = cur[i] - seen[i];
+                seen[i] = cur[i];
+            }
+            if (fresh) {
+                __atomic_store_n(&set->rtt[z], (unsigned int) (hist_percentile(h, 0.5) / 1000), __ATOMIC_RELAXED);
+            }
+            /* Timeout from the answers since the last one was set */
+            seen = set->tmoseen + z * HIST_BUCKETS;
+            for (i = 0, cnt = 0; i < HIST_BUCKETS; i++) {
+                h[i] = cur[i] - seen[i];
+                cnt += h[i];
+            }
+            if (cnt >= ZONE_TMO_SAMPLES) {
+                tmo = hist_percentile(h, 0.99) * ZONE_TMO_K / 1000;
+                tmo = tmo < ZONE_TMO_MIN ? ZONE_TMO_MIN : tmo > ZONE_TMO_MAX ? ZONE_TMO_MAX : tmo;
+                if (tmo != set->tmo[z]) {
+                    dbg("Timeout of %s now %lu ms", ZONE_NAME(set->zones, z), tmo);
+                }
+                __atomic_store_n(&set->tmo[z], (unsigned int) tmo, __ATOMIC_RELAXED);
+                __atomic_store_n(&set->hedge[z], (unsigned int) (hist_percentile(h, 0.95) / 1000 + 1), __ATOMIC_RELAXED);
+                memcpy(seen, cur, sizeof(cur));
+            }
+            health_check(set, z, answers);
+        }
+        __atomic_store_n(&set->ratestamp, now, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&set->ratelock);
+}
+
+
+/*
+ * Log the counters of each zone of the current list, and its answer
+ * times since the previous call. Called from one thread at a time.
+ */
+void cfg_log_stats(void) {
+    cfgset_t *set;
+    ctr_t h[HIST_BUCKETS];
+    ctr_t *seen;
+    char buf[64];
+    int n, z, i;
+
+    set = cfg_enter();
+    n = set->zones->nzones;
+    for (z = 0; z < n; z++) {
+        ctr_sums(set->stats, ZS_RTT(n, z), HIST_BUCKETS, h);
+        seen = set->logseen + z * HIST_BUCKETS;
+        for (i = 0; i < HIST_BUCKETS; i++) {
+            h[i] -= seen[i];
+            seen[i] += h[i];
+        }
+        syslog(LOG_INFO, "Zone %s (%s): %llu queries, %llu listed, %llu timeouts, %llu failed, "
+               "%llu skipped, opened %llu times; answer ms p50/p95/p99/max %s",
+               ZONE_NAME(set->zones, z), health_state(set, z),
+               ctr_sum(set->stats, ZS_QUESTIONS(n, z)), ctr_sum(set->stats, ZS_POSITIVE(n, z)),
+               ctr_sum(set->stats, ZS_TIMEOUTS(n, z)), ctr_sum(set->stats, ZS_SERVFAILS(n, z)),
+               ctr_sum(set->stats, ZS_SKIPPED(n, z)), ctr_sum(set->stats, ZS_OPENED(n, z)),
+               hist_format(buf, sizeof(buf), h));
+    }
+    cfg_leave();
+}
+
+
+/*
+ * Read the config file and publish it, then wait for the old list to
+ * become unused and free it.
+ */
+static void reload(void) {
+    cfgitem_t *list;
+    cfgitem_t *rbl;
+    cfgset_t *old, *set;
+    carry_t *carry;
+    unsigned long gen;
+    int changed;
+    int n = 0;
+
+    syslog(LOG_INFO, "Reloading configuration from '%s'", cfgpath);
+    if ((list = cfg_read(cfgpath, NULL)) == NULL) {
+        syslog(LOG_INFO, "Error loading configuration from '%s', keeping old config", cfgpath);
+        return;
+    }
+    for (rbl = list; rbl; rbl = rbl->next) {
+        n++;
+    }
+    old = current;
+    carry = xcalloc(n + 1, sizeof(carry_t));
+    changed = cfg_merge(old, list, carry);
+    set = cfgset_new(list);
+    cfg_carry(old, set, carry);
+    /* New zones are probed before the list goes live */
+    if (health_gate(set) < 0) {
+        syslog(LOG_NOTICE, "Shutdown during reload, new configuration not published");
+        free(carry);
+        return;
+    }
+
+    __atomic_store_n(&current, set, __ATOMIC_SEQ_CST);
+    gen = __atomic_add_fetch(&cfg_gen, 1, __ATOMIC_SEQ_CST);
+    if (changed) {
+        /* Verdicts depend on the zones and their weights */
+        vcache_flush();
+    }
+    if (cfg_synchronize(gen) != 0) {
+        goto exiting;
+    }
+    /* No request starts an evaluation on the old list any more; those
+     * kept for later requests of a session are dropped */
+    session_flush();
+    if (cfg_drain(old) != 0) {
+        goto exiting;
+    }
+    cfg_retire(old, set, carry);
+    if (changed) {
+        /* Verdicts cached by evaluations of the old list meanwhile */
+        vcache_flush();
+    }
+    dbg("Old configuration freed after generation %lu", gen);
+    cfgset_free(old);
+    free(carry);
+    syslog(LOG_INFO, "Reload ok, %d zones%s.", set->zones->nzones, changed ? "" : " (unchanged)");
+    return;
+
+    exiting:
+    /* Lookups may still point into the old list, leave it */
+    syslog(LOG_NOTICE, "Shutdown during reload, old configuration not freed");
+    free(carry);
+}
+
+
+static void *reload_th(void *data) {
+    while (1) {
+        reload();
+        pthread_mutex_lock(&reload_lock);
+        if (!reload_again || appstate != APP_RUN) {
+            reload_active = 0;
+            pthread_mutex_unlock(&reload_lock);
+            return NULL;
+        }
+        reload_again = 0;
+        pthread_mutex_unlock(&reload_lock);
+    }
+}
+
+
+/*
+ * Reload the config file in the background. Called by the event loop on
+ * SIGHUP; requests keep being served with the old zone list meanwhile.
+ * A SIGHUP during a reload is handled once that one is done.
+ */
+void reload_start(void) {
+    pthread_mutex_lock(&reload_lock);
+    if (reload_active) {
+        reload_again = 1;
+        pthread_mutex_unlock(&reload_lock);
+        syslog(LOG_INFO, "Reload in progress, reloading again when done");
+        return;
+    }
+    reload_active = 1;
+    reload_again = 0;
+    pthread_mutex_unlock(&reload_lock);
+    if (reload_running) {
+        pthread_join(reload_tid, NULL);
+        reload_running = 0;
+    }
+    if (pthread_create(&reload_tid, NULL, reload_th, NULL) != 0) {
+        syslog(LOG_ERR, "Could not start reload thread");
+        reload_active = 0;
+        return;
+    }
+    reload_running = 1;
+}
+
+
+/*
+ * Join a reload still running, at shutdown
+ */
+void reload_wait(void) {
+    if (reload_running) {
+        pthread_join(reload_tid, NULL);
+        reload_running = 0;
+    }
+}
@@ -0,0 +1,107 @@
+/*
+   rblpolicyd - a policy daemon for Postfix (http://www.postfix.org/),
+   which allows combining different RBLs with weights.
+
+   $Id$
+   Public configuration publishing and reload interface
+
+   Copyright (C) 2004 Thomas Lamy
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#ifndef __RELOAD_H
+#define __RELOAD_H
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/*
+ * A published zone list. The table never changes once published; a
+ * reload publishes a new one and frees the old one when nobody uses it.
+ */
+typedef struct cfgset {
+    zonetab_t *zones;
+    struct ctrset *stats;      /* per-thread zone counters, see ZS_*() */
+    unsigned int refs;         /* evaluations still using it */
+    /* The planner's view of the counters, refreshed once a second */
+    pthread_mutex_t ratelock;
+    unsigned int ratestamp;    /* cache_now() of the last refresh */
+    unsigned int *hitrate;     /* (positive + 1) / (questions + 2), 16.16 */
+    unsigned int *rtt;         /* ms, median answer time */
+    unsigned int *tmo;         /* ms per DNS attempt */
+    unsigned int *hedge;       /* ms, p95 of the answer times, 0 = unknown */
+    ctr_t *rttseen;            /* answer times as of the last refresh */
+    ctr_t *tmoseen;            /* answer times as of the last new timeout */
+    ctr_t *logseen;            /* answer times as of the last cfg_log_stats() */
+    /* Circuit breakers, see health.c */
+    unsigned int *health;      /* ZONE_CLOSED, ZONE_OPEN or ZONE_HALFOPEN */
+    unsigned int *reopen;      /* cache_now() of the next probe of an open zone */
+    unsigned int *backoff;     /* s between probes of an open zone */
+    unsigned int *probing;     /* probe in flight */
+    unsigned int *flush;       /* cached answers to drop */
+    ctr_t *healthseen;         /* counters as of the last judgement */
+} cfgset_t;
+
+/*
+ * A zone's DNS timeout is ZONE_TMO_K times the p99 of its answer times,
+ * and its lookups are hedged after the p95, both recomputed every
+ * ZONE_TMO_SAMPLES answers
+ */
+#define ZONE_TMO_K          4
+#define ZONE_TMO_MIN        100     /* ms */
+#define ZONE_TMO_MAX        1000    /* ms, also used until there are answers */
+#define ZONE_TMO_SAMPLES    100
+
+/*
+ * Counter slots of zone z, out of n: ZS_COUNTERS counters, then
+ * ZS_RTT(), a histogram
+ */
+#define ZS_COUNT(k, n, z)     ((k) * (n) + (z))
+#define ZS_QUESTIONS(n, z)    ZS_COUNT(0, n, z)
+#define ZS_POSITIVE(n, z)     ZS_COUNT(1, n, z)
+#define ZS_TIMEOUTS(n, z)     ZS_COUNT(2, n, z)
+#define ZS_SERVFAILS(n, z)    ZS_COUNT(3, n, z)
+#define ZS_SKIPPED(n, z)      ZS_COUNT(4, n, z)    /* lookups left out, circuit open */
+#define ZS_OPENED(n, z)       ZS_COUNT(5, n, z)    /* circuit opened */
+#define ZS_COUNTERS           6
+#define ZS_RTT(n, z)          (ZS_COUNTERS * (n) + (z) * HIST_BUCKETS)
+#define ZS_SLOTS(n)           ((ZS_COUNTERS + HIST_BUCKETS) * (n))
+
+int cfg_publish_init(cfgitem_t *list);
+
+void cfg_shutdown(void);
+
+cfgset_t *cfg_enter(void);
+
+void cfg_leave(void);
+
+int cfg_stale(cfgset_t *set);
+
+void cfg_hold(cfgset_t *set);
+
+void cfg_release(cfgset_t *set);
+
+void cfg_rates(cfgset_t *set);
+
+void cfg_log_stats(void);
+
+void reload_start(void);
+
+void reload_wait(void);
+
+#endif
@@ -0,0 +1,149 @@
+/*
+   rblpolicyd - a policy daemon for Postfix (http://www.postfix.org/),
+   which allows combining different RBLs with weights.
+
+   $Id$
+   Postfix policy request parser
+
+   Copyright (C) 2004 Thomas Lamy
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include "system.h"
+
+#include "request.h"
+
+/*
+ * A policy request is a list of name=value lines, terminated by an empty
+ * line; lines may end in \r\n. The parser is fed each chunk as it is
+ * read and looks at every byte once: memchr() finds the line ends and,
+ * within a line, the first '='. Attributes are recorded as slices of
+ * the connection's buffer, nothing is copied.
+ */
+
+
+void req_reset(request_t *rq) {
+    rq->line = 0;
+    rq->eq = -1;
+    rq->end = 0;
+    rq->nattr = 0;
+}
+
+
+/*
+ * Parse the bytes buf[from..to). Returns 1 once the empty line has been
+ * seen; rq->end is then the length of the request, and the values are
+ * NUL terminated in place. Returns 0 if more input is needed.
+ */
+int req_feed(request_t *rq, char *buf, int from, int to) {
+    char *nl, *eq;
+    int eol, end;
+    reqattr_t *a;
+
+    while (from < to) {
+        nl = memchr(buf + from, '\n', to - from);
+        eol = nl ? nl - buf : to;
+        if (rq->eq < 0 && (eq = memchr(buf + from, '=', eol - from)) != NULL) {
+            rq->eq = eq - buf;
+        }
+        if (!nl) {
+            break;
+        }
+        end = eol;
+        if (end > rq->line && buf[end - 1] == '\r') {
+            end--;
+        }
+        if (end == rq->line) {
+            rq->end = eol + 1;
+            return 1;
+        }
+        if (rq->eq >= 0 && rq->nattr < REQ_MAXATTR) {
+            a = &rq->attr[rq->nattr++];
+            a->name = rq->line;
+            a->namelen = rq->eq - rq->line;
+            a->value = rq->eq + 1;
+            a->vallen = end - rq->eq - 1;
+            buf[end] = '\0';
+        }
+        rq->line = eol + 1;
+        rq->eq = -1;
+        from = eol + 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Value of attribute name in a complete request, or NULL.
+ * Points into buf, which must be the buffer the request was parsed from.
+ */
+const char *req_get(const request_t *rq, const char *buf, const char *name) {
+    int len = strlen(name);
+    int i;
+
+    for (i = 0; i < rq->nattr; i++) {
+        if (rq->attr[i].namelen == len && memcmp(buf + rq->attr[i].name, name, len) == 0) {
+            return buf + rq->attr[i].value;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Parse a dotted quad strictly: four decimal octets of one to three
+ * digits, nothing before or after. Returns 0 and the address in host
+ * byte order, -1 if s isn't an IPv4 address.
+ */
+int req_ipv4(const char *s, unsigned int *ip) {
+    unsigned int addr = 0;
+    unsigned int octet;
+    int digits;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        octet = 0;
+        for (digits = 0; *s >= '0' && *s <= '9'; digits++, s++) {
+            if (digits == 3) {
+                return -1;
+            }
+            octet = octet * 10 + (*s - '0');
+        }
+        if (digits == 0 || octet > 255) {
+            return -1;
+        }
+        if (*s != (i < 3 ? '.' : '\0')) {
+            return -1;
+        }
+        s++;
+        addr = addr << 8 | octet;
+    }
+    *ip = addr;
+    return 0;
+}
@@ -0,0 +1,63 @@
+/*
+   rblpolicyd - a policy daemon for Postfix (http://www.postfix.org/),
+   which allows combining different RBLs with weights.
+
+   $Id$
+   Postfix policy request parser
+
+   Copyright (C) 2004 Thomas Lamy
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#ifndef __REQUEST_H
+#define __REQUEST_H
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define REQ_MAXATTR    32      /* attributes recorded per request */
+
+/* An attribute as offsets into the request buffer */
+typedef struct {
+    unsigned short name;
+    unsigned short namelen;
+    unsigned short value;
+    unsigned short vallen;
+} reqattr_t;
+
+/*
+ * Parser state, one per connection. Offsets rather than pointers, as
+ * the buffer may move while the request is still coming in.
+ */
+typedef struct {
+    int line;              /* start of the current line */
+    int eq;                /* '=' in the current line, -1 if not seen yet */
+    int end;               /* length of the request incl. the empty line */
+    int nattr;
+    reqattr_t attr[REQ_MAXATTR];
+} request_t;
+
+void req_reset(request_t *rq);
+
+int req_feed(request_t *rq, char *buf, int from, int to);
+
+const char *req_get(const request_t *rq, const char *buf, const char *name);
+
+int req_ipv4(const char *s, unsigned int *ip);
+
+#endif
@@ -44,15 +44,25 @@
 #endif
 
 #include <pthread.h>
+#include <stdint.h>
 
 #include "system.h"
 
 #include "cfgfile.h"
+#include "dns.h"
+#include "cache.h"
+#include "request.h"
+#include "evloop.h"
+#include "session.h"
+#include "counters.h"
+#include "reload.h"
+#include "health.h"
 #include "thrmgr.h"
 #include "server.h"
 #include "worker.h"
 #include "stats.h"
 #include "globals.h"
+#include "xmalloc.h"
 
 
 static void sigterm(int signo) {
@@ -61,81 +71,15 @@ static void sigterm(int signo) {
 }
 
 
-#define CHUNK    1024
-
-static char *read_request(int sock) {
-    char *buf = NULL;
-    fd_set fds;
-    int bufsize = 0;
-    int bread = 0;
-    struct timeval tv;
-    int ret;
-
-    FD_ZERO(&fds);
-    FD_SET(sock, &fds);
-
-    tv.tv_sec = 10;
-    tv.tv_usec = 0;
-
-    while (1) {
-        ret = select(sock + 1, &fds, NULL, NULL, &tv);
-        if (ret < 0) {
-            syslog(LOG_NOTICE, "select(): %s", strerror(errno));
-            if (buf) {
-                free(buf);
-            }
-            return NULL;
-        } else if (ret == 0) {
-            // syslog(LOG_NOTICE, "Timeout reading request (%d bytes read so far)", bread);
-            if (buf && bufsize > bread) {
-                buf[bread] = '\0';
-            }
-            return buf;
-        } else {
-            if (bufsize - bread < CHUNK) {
-                bufsize += CHUNK;
-                buf = realloc(buf, bufsize);
-                if (buf == NULL) {
-                    syslog(LOG_ERR, "Could not realloc receive buffer to %d bytes: %s", bufsize, strerror(errno));
-                    return NULL;
-                }
-            }
-            ret = read(sock, buf + bread, bufsize - bread - 1);
-            if (ret <= 0) {
-                syslog(LOG_NOTICE, "Could not read from socket: %s", strerror(errno));
-                if (buf && bufsize > bread) {
-                    buf[bread] = '\0';
-                }
-                return buf;
-            }
-            bread += ret;
-            buf[bread] = '\0';
-            if (strcmp(buf + bread - 4, "\r\n\r\n") == 0 || strcmp(buf + bread - 2, "\n\n") == 0) {
-                /* two line terminators -> end of request */
-                break;
-            }
-        }
-    }
-    return buf;
-}
-
-static int num_requests = 0;
 static time_t start = 0;
 
-static void sigstatus(int sig) {
-    stats_log();
-}
-
 int server(int sock, struct sockaddr *sa, socklen_t salen) {
     int ret;
-    int conn;
-    cfgitem_t *newlist;
-    struct sigaction sa_term, sa_usr1;
+    struct sigaction sa_term;
     sigset_t sigset;
 
     /* Setup signal handling */
     memset(&sa_term, 0, sizeof(struct sigaction));
-    memset(&sa_usr1, 0, sizeof(struct sigaction));
     sigfillset(&sigset);
 
     sa_term.sa_handler = sigterm;
@@ -147,71 +91,59 @@ int server(int sock, struct sockaddr *sa, socklen_t salen) {
     sigdelset(&sigset, SIGTERM);
     sigdelset(&sigset, SIGINT);
 
-    sa_usr1.sa_handler = sigstatus;
-    sigemptyset(&sa_usr1.sa_mask);
-    sigaddset(&sa_usr1.sa_mask, SIGUSR1);
-    sigaction(SIGUSR1, &sa_usr1, NULL);
-    sigdelset(&sigset, SIGUSR1);
-
+    /* SIGHUP and SIGUSR1 stay blocked, the event loop reads them from a
+     * signalfd */
     sigprocmask(SIG_SETMASK, &sigset, NULL);
 
     /* Initialize statistics module */
     stats_start();
 
-    /* Accept new network connections */
+    /* Workers take the zone list from here on */
+    cfg_publish_init(rblist);
+    rblist = NULL;
+
+    /* Start the DNS engine and the worker pool */
+    if (cache_init(cachesize) != 0 || vcache_init(verdictsize) != 0 || session_init(sessionsize) != 0) {
+        return -1;
+    }
+    if (dns_init(nslist, dnssockets, maxinflight) != 0) {
+        syslog(LOG_ERR, "Could not start DNS engine");
+        return -1;
+    }
+    /* Zones failing their first probe never see a request */
+    if (health_start() != 0) {
+        dns_shutdown();
+        return -1;
+    }
+    if (maxthreads > 0 && (ret = wpool_init(maxthreads, queuedepth)) != 0) {
+        syslog(LOG_ERR, "Could not start worker pool: %s", thr_error(-ret));
+        health_stop();
+        dns_shutdown();
+        return -1;
+    }
+    if (ev_init(sock) != 0) {
+        wpool_shutdown();
+        health_stop();
+        dns_shutdown();
+        return -1;
+    }
+
+    /* Serve connections from the event loop */
     start = time(NULL);
     while (appstate != APP_EXIT && appstate != APP_ERROR) {
-        socklen_t salen = sizeof(*sa);
-        dbg("Waiting for connection");
-        ret = accept(sock, sa, &salen);
-        if (ret < 0) {
-            if (errno != EINTR) {
-                syslog(LOG_ERR, "accept() failure: %s", strerror(errno));
-            } else {
-                dbg("accept(): interrupted; appstate=%d", (int) appstate);
-                if (appstate == APP_RUN) {
-                    continue;
-                }
-                break;
-            }
+        if (ev_run() != 0) {
             close(sock);
-            if (appstate == APP_RUN) {
-                appstate = APP_ERROR;
-            }
+            appstate = APP_ERROR;
             break;
         }
+        dbg("Event loop interrupted; appstate=%d", (int) appstate);
         switch (appstate) {
             case APP_RUN:
-                conn = ret;
-                num_requests++;
-                dbg("Accepted connection; sock=%d conn=%d", sock, conn);
-                if (maxthreads > 0) {
-                    if ((ret = wthread_create(conn)) != 0) {
-                        syslog(LOG_NOTICE, "Could not create new worker thread; closing request: %s", thr_error(ret));
-                        shutdown(conn, SHUT_RDWR);
-                        close(conn);
-                    }
-                } else {
-                    worker_th((void *) conn);
-                }
                 break;
 
             case APP_RELOAD:
-                /* TODO: Testing */
-                if ((ret = thr_waitcomplete()) != 0) {
-                    syslog(LOG_NOTICE, "Could not reload configuration; %d workers still alive", ret);
-                    appstate = APP_RUN;    /* perhaps APP_EXIT? */
-                    break;
-                }
-                syslog(LOG_INFO, "Reloading configuration from '%s'", cfgpath);
-                newlist = cfg_read(cfgpath);
-                if (!newlist) {
-                    syslog(LOG_INFO, "Error loading configuration from '%s', keeping old config", cfgpath);
-                } else {
-                    cfg_free(&rblist);
-                    rblist = newlist;
-                    syslog(LOG_INFO, "Reload ok.");
-                }
+                /* Normally started from the event loop on SIGHUP */
+                reload_start();
                 appstate = APP_RUN;
                 break;
 
@@ -220,134 +152,15 @@ int server(int sock, struct sockaddr *sa, socklen_t salen) {
                 break;
         }
     }
+    wpool_shutdown();
+    health_stop();
+    dns_shutdown();
+    ev_free();
+    reload_wait();
+    session_free();
+    vcache_free();
+    cache_free();
+    cfg_shutdown();
+    arena_shutdown();
     return 0;
 }
-
-char *parse_request(char *const req) {
-    char *c, *p;
-    char *result;
-    if ((c = strstr(req, "client_address=")) == NULL) {
-        return NULL;
-    }
-    c += 15;    /* skip to first value byte */
-    if ((p = strchr(c, '\r')) == NULL) {
-        p = strchr(c, '\n');
-    }
-    if (!p) {
-        syslog(LOG_NOTICE, "EOL terminator not found in '%s'", c - 15);
-        return NULL;
-    }
-    result = malloc(p - c + 1);
-    if (!result) {
-        syslog(LOG_NOTICE, "Could not allocate %d bytes for client address", p - c + 1);
-        return NULL;
-    }
-    memcpy(result, c, p - c);
-    result[p - c] = '\0';
-    return result;
-}
-
-
-void process_request(int conn) {
-    char *request = NULL;
-    char *client = NULL;
-    char rqname[1024];
-    int score = 0;
-    int err = 0;
-    char *rdn = NULL;
-    cfgitem_t *rbl;
-    struct hostent *h;
-    char *reply = NULL;
-    int replen = 0;
-    char result[128];
-    int o1 = -1, o2 = -1, o3 = -1, o4 = -1;
-
-    request = read_request(conn);
-    if (!request) {
-        syslog(LOG_NOTICE, "Error reading request");
-        err++;
-    }
-    if (!err) {
-        client = parse_request(request);
-        if (!client) {
-            syslog(LOG_NOTICE, "Could not parse request '%s'", request);
-            err++;
-        }
-    }
-    if (!err) {
-        dbg("Client address: '%s'", client);
-        rdn = malloc(strlen(client) + 1);
-        if (!rdn) {
-            err++;
-        }
-    }
-    if (!err) {
-        rdn[0] = '\0';
-        if (sscanf(client, "%d.%d.%d.%d", &o1, &o2, &o3, &o4) != 4) {
-            syslog(LOG_NOTICE, "Invalid client address '%s'", client);
-            err++;
-        }
-    }
-    if (!err) {
-        sprintf(rdn, "%d.%d.%d.%d", o4, o3, o2, o1);
-        dbg("Reverse client address: '%s'", rdn);
-        for (rbl = rblist; rbl && score < 100; rbl = rbl->next) {
-            sprintf(rqname, "%s.%s", rdn, rbl->rbldomain);
-            dbg("Lookup '%s'", rqname);
-            h = gethostbyname(rqname);
-            if (h) {
-                if (h->h_addrtype == AF_INET) {
-                    char **addrlist = h->h_addr_list;
-                    for (; *addrlist != NULL; addrlist++) {
-                        inet_ntop(AF_INET, *addrlist, result, 127);
-                        dbg("'%s' = %s", rqname, result);
-                        if (strncmp(result, "127.", 4) == 0) {
-                            dbg("%s found in %s", client, rbl->rbldomain);
-                            if (reply) {
-                                replen += 2 + strlen(rbl->rbldomain);
-                                reply = realloc(reply, replen);
-                                strcat(reply, ", ");
-                            } else {
-                                replen += strlen(rbl->rbldomain) + 1;
-                                reply = malloc(replen);
-                                reply[0] = '\0';
-                            }
-                            strcat(reply, rbl->rbldomain);
-                            score += rbl->weight;
-                            break;
-                        } /* endif (127.0.0.x) */
-                    } /* end foreach(host) */
-                } /* endif AF_INET */
-            } /* endif h */
-            if (score >= 100) {
-                break;
-            }
-        } /* end foreach(rbl) */
-    } /* endif(!err) */
-    if (!err && score >= 100) {
-        dbg("Reply: 'action=REJECT Blocked through %s\\r\\n\\r\\n'", reply);
-        write(conn, "action=REJECT Blocked through ", 30);
-        write(conn, reply, strlen(reply));
-        // write(conn, "\r\n\r\n", 4);
-        write(conn, "\n\n", 2);
-    } else {
-        dbg("Reply: 'action=DUNNO\\n\\n'");
-        write(conn, "action=DUNNO", 12);
-        // write(conn, "\r\n\r\n", 4);
-        write(conn, "\n\n", 2);
-    }
-    if (request) {
-        free(request);
-    }
-    if (client) {
-        free(client);
-    }
-    if (rdn) {
-        free(rdn);
-    }
-    if (reply) {
-        free(reply);
-    }
-    close(conn);
-}
-
@@ -28,5 +28,3 @@
 
 extern int server(int sock, struct sockaddr *sa, socklen_t salen);
 
-extern char *parse_request(char *const req);
-
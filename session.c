@@ -0,0 +1,273 @@
+/*
+   rblpolicyd - a policy daemon for Postfix (http://www.postfix.org/),
+   which allows combining different RBLs with weights.
+
+   $Id$
+   Memo of the answers given within one SMTP session
+
+   Copyright (C) 2004 Thomas Lamy
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+
+#include <stdio.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <pthread.h>
+
+#include "system.h"
+
+#include "cfgfile.h"
+#include "cache.h"
+#include "session.h"
+#include "worker.h"
+#include "stats.h"
+#include "globals.h"
+#include "xmalloc.h"
+
+/*
+ * Postfix sends one policy request per recipient, all with the same
+ * instance attribute. The answer to the first one is remembered here so
+ * the others don't need an evaluation of their own. An entry may instead
+ * hold an evaluation started early in the session, for a later request
+ * to join.
+ *
+ * The memo is small and set-associative like the DNS cache; within a set
+ * the least recently used entry goes first. Entries idle for SESSION_IDLE
+ * seconds are dead.
+ */
+
+#define SESSION_WAYS     4
+#define SESSION_LOCKS    64
+
+typedef struct {
+    char instance[SESSION_KEYLEN];
+    unsigned int ip;
+    unsigned int used;     /* cache_now() of the last hit, 0 = empty */
+    char *answer;
+    int anslen;
+    evalctx_t *ctx;        /* evaluation in progress, instead of answer */
+} sentry_t;
+
+static sentry_t *sessions = NULL;
+static unsigned int session_mask = 0;
+static pthread_mutex_t session_locks[SESSION_LOCKS];
+
+
+static unsigned int session_hash(const char *instance) {
+    unsigned int h = 2166136261U;
+
+    while (*instance) {
+        h = (h ^ (unsigned char) *instance++) * 16777619U;
+    }
+    return h;
+}
+
+
+/*
+ * Allocate a memo for about entries sessions (0 disables it)
+ */
+int session_init(int entries) {
+    unsigned int nsets = 1;
+    int i;
+
+    for (i = 0; i < SESSION_LOCKS; i++) {
+        pthread_mutex_init(&session_locks[i], NULL);
+    }
+    if (entries <= 0) {
+        return 0;
+    }
+    while (nsets * 2 * SESSION_WAYS <= (unsigned int) entries) {
+        nsets <<= 1;
+    }
+    if ((sessions = calloc(nsets * SESSION_WAYS, sizeof(sentry_t))) == NULL) {
+        syslog(LOG_ERR, "Could not allocate session memo of %u entries", nsets * SESSION_WAYS);
+        return -1;
+    }
+    session_mask = nsets - 1;
+    dbg("Session memo: %u entries", nsets * SESSION_WAYS);
+    return 0;
+}
+
+
+void session_free(void) {
+    int i;
+
+    session_flush();
+    for (i = 0; i < SESSION_LOCKS; i++) {
+        pthread_mutex_destroy(&session_locks[i]);
+    }
+    free(sessions);
+    sessions = NULL;
+}
+
+
+/* Empty e, caller holds the set's lock */
+static void session_clear(sentry_t *e) {
+    if (e->answer) {
+        free(e->answer);
+    }
+    if (e->ctx) {
+        eval_release(e->ctx);
+    }
+    memset(e, 0, sizeof(sentry_t));
+}
+
+
+/*
+ * Look up this session. The client address must match too. On a hit,
+ * 1 is returned and either *answer is a malloc()ed copy of the answer
+ * given, or *ctx is the evaluation still running, with a reference held
+ * for the caller.
+ */
+int session_get(const char *instance, unsigned int ip, char **answer, int *len, evalctx_t **ctx) {
+    unsigned int set, now;
+    sentry_t *e;
+    int i, hit = 0;
+
+    if (!sessions || strlen(instance) >= SESSION_KEYLEN) {
+        return 0;
+    }
+    now = cache_now();
+    set = session_hash(instance) & session_mask;
+    pthread_mutex_lock(&session_locks[set % SESSION_LOCKS]);
+    for (i = 0, e = &sessions[set * SESSION_WAYS]; i < SESSION_WAYS; i++, e++) {
+        if (e->used && now - e->used < SESSION_IDLE && e->ip == ip && strcmp(e->instance, instance) == 0) {
+            e->used = now;
+            if (e->ctx) {
+                eval_hold(e->ctx);
+                *ctx = e->ctx;
+                *answer = NULL;
+            } else {
+                *answer = xmalloc(e->anslen + 1);
+                memcpy(*answer, e->answer, e->anslen + 1);
+                *len = e->anslen;
+                *ctx = NULL;
+            }
+            hit = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&session_locks[set % SESSION_LOCKS]);
+    if (hit) {
+        stats_session_hit();
+    }
+    return hit;
+}
+
+
+/*
+ * Find the entry for instance, or the one to replace. Caller holds the
+ * set's lock.
+ */
+static sentry_t *session_slot(unsigned int set, const char *instance, unsigned int now) {
+    sentry_t *e, *victim = NULL;
+    unsigned int age, oldest = 0;
+    int i;
+
+    for (i = 0, e = &sessions[set * SESSION_WAYS]; i < SESSION_WAYS; i++, e++) {
+        if (e->used && strcmp(e->instance, instance) == 0) {
+            return e;
+        }
+        /* Empty and expired entries go first, then the least recently used */
+        age = (!e->used || now - e->used >= SESSION_IDLE) ? 0 : e->used;
+        if (!victim || age < oldest) {
+            victim = e;
+            oldest = age;
+        }
+    }
+    return victim;
+}
+
+
+/*
+ * Remember the answer for the rest of the session
+ */
+void session_put(const char *instance, unsigned int ip, const char *answer, int len) {
+    unsigned int set, now;
+    sentry_t *victim;
+
+    if (!sessions || !instance[0] || strlen(instance) >= SESSION_KEYLEN) {
+        return;
+    }
+    now = cache_now();
+    set = session_hash(instance) & session_mask;
+    pthread_mutex_lock(&session_locks[set % SESSION_LOCKS]);
+    victim = session_slot(set, instance, now);
+    session_clear(victim);
+    strcpy(victim->instance, instance);
+    victim->ip = ip;
+    victim->used = now;
+    victim->answer = xmalloc(len + 1);
+    memcpy(victim->answer, answer, len);
+    victim->answer[len] = '\0';
+    victim->anslen = len;
+    pthread_mutex_unlock(&session_locks[set % SESSION_LOCKS]);
+}
+
+
+/*
+ * Leave an evaluation for later requests of the session to join.
+ * The memo takes its own reference.
+ */
+void session_put_eval(const char *instance, unsigned int ip, evalctx_t *ctx) {
+    unsigned int set, now;
+    sentry_t *victim;
+
+    if (!sessions || !instance[0] || strlen(instance) >= SESSION_KEYLEN) {
+        return;
+    }
+    now = cache_now();
+    set = session_hash(instance) & session_mask;
+    pthread_mutex_lock(&session_locks[set % SESSION_LOCKS]);
+    victim = session_slot(set, instance, now);
+    session_clear(victim);
+    strcpy(victim->instance, instance);
+    victim->ip = ip;
+    victim->used = now;
+    eval_hold(ctx);
+    victim->ctx = ctx;
+    pthread_mutex_unlock(&session_locks[set % SESSION_LOCKS]);
+}
+
+
+/*
+ * Forget all sessions, e.g. after the zone list changed
+ */
+void session_flush(void) {
+    unsigned int i;
+
+    if (!sessions) {
+        return;
+    }
+    for (i = 0; i < (session_mask + 1) * SESSION_WAYS; i++) {
+        pthread_mutex_lock(&session_locks[(i / SESSION_WAYS) % SESSION_LOCKS]);
+        session_clear(&sessions[i]);
+        pthread_mutex_unlock(&session_locks[(i / SESSION_WAYS) % SESSION_LOCKS]);
+    }
+}
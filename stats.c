@@ -53,18 +53,54 @@
 #include "system.h"
 
 #include "cfgfile.h"
+#include "dns.h"
 #include "thrmgr.h"
 #include "worker.h"
+#include "counters.h"
+#include "reload.h"
 #include "stats.h"
 #include "globals.h"
 
-#define RINGBUFFERS    16
-
-typedef struct {
-    unsigned int count;
-    unsigned int index;
-    int val[RINGBUFFERS];
-} ring_t;
+/*
+ * Counts are kept per thread in a counter set (see counters.c) and
+ * summed by stats_log(). Times go into histograms, reported for the
+ * time since the previous report. Gauges and maxima are single words
+ * updated with relaxed atomics.
+ */
+enum {
+    ST_REQUESTS = 0,
+    ST_REJECT,
+    ST_DUNNO,
+    ST_INVALID,
+    ST_LATE,
+    ST_OVERLOADED,
+    ST_LOOKUPS,
+    ST_COALESCED,
+    ST_HEDGES,
+    ST_HEDGE_WINS,
+    ST_CACHE_HITS,
+    ST_CACHE_MISSES,
+    ST_CACHE_EVICTIONS,
+    ST_VERDICT_HITS,
+    ST_VERDICT_MISSES,
+    ST_SESSION_HITS,
+    ST_PLANNED,
+    ST_SAVED,
+    ST_CONNECTIONS,
+    ST_CONN_REQUESTS,
+    ST_ALLOC_REQUESTS,
+    ST_ALLOC_HEAP,
+    ST_ALLOC_ARENA,
+    /* histograms */
+    ST_H_REQUEST,
+    ST_H_QUEUEWAIT = ST_H_REQUEST + HIST_BUCKETS,
+    ST_H_SOLVERWAIT = ST_H_QUEUEWAIT + HIST_BUCKETS,
+    ST_H_SOLVER = ST_H_SOLVERWAIT + HIST_BUCKETS,
+    ST_SLOTS = ST_H_SOLVER + HIST_BUCKETS
+};
+
+static ctrset_t *counters = NULL;
+static __thread ctr_t *local = NULL;
 
 static int max_workers = 0;
 static int max_solvers = 0;
@@ -72,113 +108,229 @@ static int num_workers = 0;
 static int num_solvers = 0;
 static int now_workers = 0;
 static int now_solvers = 0;
-static ring_t workertime;
-static ring_t solvertime;
+static int now_queued = 0;
+static int max_queued = 0;
+static int max_conn_requests = 0;
 static time_t start;
-static int requests;
 
-void stats_worker_thr(int num) {
-    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-    pthread_mutex_lock(&mutex);
-    num_workers++;
-    now_workers = num;
-    if (num > max_workers) {
-        max_workers = num;
+/* Sums as of the previous report, for the histograms */
+static ctr_t last[ST_SLOTS];
+
+
+/* This thread's slots */
+static inline ctr_t *stats_local(void) {
+    if (local == NULL) {
+        local = ctr_local(counters);
     }
-    pthread_mutex_unlock(&mutex);
-    return;
+    return local;
 }
 
 
-void stats_worker_time(struct timeval *start, struct timeval *end) {
-    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-    unsigned long long l_start, l_end;
-    int duration;
-    static char init = 0;
+static inline void stats_count(int slot, ctr_t n) {
+    ctr_t *v = stats_local();
 
-    if (init == 0) {
-        pthread_mutex_lock(&mutex);
-        memset(&workertime, 0, sizeof(workertime));
-        pthread_mutex_unlock(&mutex);
-        init = 1;
-    }
-    l_end = end->tv_usec / 1000 + end->tv_sec;
-    l_start = start->tv_usec / 1000 + start->tv_sec;
-    duration = (l_end - l_start);
-    pthread_mutex_lock(&mutex);
-    workertime.val[workertime.index] = duration;
-    if (workertime.count < RINGBUFFERS) {
-        workertime.count++;
-    }
-    workertime.index = (workertime.index + 1) % RINGBUFFERS;
-    pthread_mutex_unlock(&mutex);
+    CTR_ADD(v, slot, n);
+}
+
+
+static inline void stats_hist(int base, unsigned long us) {
+    ctr_t *v = stats_local();
+
+    HIST_ADD(v, base, us);
+}
+
+#define COUNT(slot, n)    stats_count(slot, n)
+
+
+static unsigned long tv_diff_us(struct timeval *start, struct timeval *end) {
+    long us = (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_usec - start->tv_usec);
+
+    return us > 0 ? (unsigned long) us : 0;
+}
+
+
+/*
+ * Current time for the timing functions below. Monotonic, unlike
+ * gettimeofday().
+ */
+void stats_clock(struct timeval *tv) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    tv->tv_sec = ts.tv_sec;
+    tv->tv_usec = ts.tv_nsec / 1000;
+}
+
+
+static void gauge_max(int *max, int val) {
+    int cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+    while (val > cur && !__atomic_compare_exchange_n(max, &cur, val, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+void stats_worker_thr(int num) {
+    __atomic_add_fetch(&num_workers, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&now_workers, num, __ATOMIC_RELAXED);
+    gauge_max(&max_workers, num);
+}
+
+
+/*
+ * Time from a request being read until its answer was handed to the
+ * event loop
+ */
+void stats_request_time(struct timeval *start, struct timeval *end) {
+    stats_hist(ST_H_REQUEST, tv_diff_us(start, end));
 }
 
 
 void stats_solver_thr(int num) {
-    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-    pthread_mutex_lock(&mutex);
-    num_solvers++;
-    now_solvers = num;
-    if (num > max_solvers) {
-        max_solvers = num;
-    }
-    pthread_mutex_unlock(&mutex);
-    return;
+    __atomic_store_n(&num_solvers, num, __ATOMIC_RELAXED);
 }
 
 
+/*
+ * Time from sending a lookup until its answer or timeout
+ */
 void stats_solver_time(struct timeval *start, struct timeval *end) {
-    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-    unsigned long long l_start, l_end;
-    int duration;
-    static char init = 0;
-
-    if (init == 0) {
-        pthread_mutex_lock(&mutex);
-        memset(&solvertime, 0, sizeof(solvertime));
-        pthread_mutex_unlock(&mutex);
-        init = 1;
-    }
-    l_end = end->tv_usec / 1000 + end->tv_sec;
-    l_start = start->tv_usec / 1000 + start->tv_sec;
-    duration = (l_end - l_start);
-    pthread_mutex_lock(&mutex);
-    solvertime.val[solvertime.index] = duration;
-    if (solvertime.count < RINGBUFFERS) {
-        solvertime.count++;
+    stats_hist(ST_H_SOLVER, tv_diff_us(start, end));
+}
+
+
+/*
+ * Time a lookup spent waiting to be sent
+ */
+void stats_solver_wait(struct timeval *start, struct timeval *end) {
+    stats_hist(ST_H_SOLVERWAIT, tv_diff_us(start, end));
+}
+
+
+/*
+ * A lookup has been taken over by the DNS thread. Coalesced ones wait
+ * for the answer of the same question sent before.
+ */
+void stats_solver_lookup(int coalesced) {
+    ctr_t *v = stats_local();
+
+    CTR_ADD(v, ST_LOOKUPS, 1);
+    if (coalesced) {
+        CTR_ADD(v, ST_COALESCED, 1);
     }
-    solvertime.index = (solvertime.index + 1) % RINGBUFFERS;
-    pthread_mutex_unlock(&mutex);
 }
 
 
-void stats_request() {
-    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-    pthread_mutex_lock(&mutex);
-    requests++;
-    pthread_mutex_unlock(&mutex);
-    return;
+/*
+ * A hedge, a copy of a slow lookup, has been sent to another upstream,
+ * or it answered first
+ */
+void stats_solver_hedge(int won) {
+    COUNT(won ? ST_HEDGE_WINS : ST_HEDGES, 1);
 }
 
 
-void stats_start() {
-    start = time(NULL);
-    return;
+void stats_solver_inflight(int num) {
+    __atomic_store_n(&now_solvers, num, __ATOMIC_RELAXED);
+    gauge_max(&max_solvers, num);
 }
 
 
-static int ring_average(ring_t *r) {
-    int i;
-    unsigned long long sum = 0;
+void stats_queue_depth(int depth) {
+    __atomic_store_n(&now_queued, depth, __ATOMIC_RELAXED);
+    gauge_max(&max_queued, depth);
+}
 
-    if (!r || !r->count) {
-        return 0;
-    }
-    for (i = 0; i < r->count; i++) {
-        sum += r->val[i];
+
+/*
+ * Time a connection spent in the worker queue
+ */
+void stats_queue_wait(struct timeval *start, struct timeval *end) {
+    stats_hist(ST_H_QUEUEWAIT, tv_diff_us(start, end));
+}
+
+
+void stats_overload(void) {
+    COUNT(ST_OVERLOADED, 1);
+}
+
+
+void stats_cache_hit(void) {
+    COUNT(ST_CACHE_HITS, 1);
+}
+
+
+void stats_cache_miss(void) {
+    COUNT(ST_CACHE_MISSES, 1);
+}
+
+
+void stats_cache_evict(void) {
+    COUNT(ST_CACHE_EVICTIONS, 1);
+}
+
+
+void stats_verdict_hit(void) {
+    COUNT(ST_VERDICT_HITS, 1);
+}
+
+
+void stats_verdict_miss(void) {
+    COUNT(ST_VERDICT_MISSES, 1);
+}
+
+
+void stats_session_hit(void) {
+    COUNT(ST_SESSION_HITS, 1);
+}
+
+
+/* Allocations a worker made for one request */
+void stats_allocs(unsigned long heap, unsigned long arena) {
+    COUNT(ST_ALLOC_REQUESTS, 1);
+    COUNT(ST_ALLOC_HEAP, heap);
+    COUNT(ST_ALLOC_ARENA, arena);
+}
+
+
+/* Zones an evaluation got away without asking */
+void stats_planner(int saved) {
+    COUNT(ST_PLANNED, 1);
+    COUNT(ST_SAVED, saved);
+}
+
+
+/* A client connection has been closed after answering requests */
+void stats_connection(int requests) {
+    COUNT(ST_CONNECTIONS, 1);
+    COUNT(ST_CONN_REQUESTS, requests);
+    gauge_max(&max_conn_requests, requests);
+}
+
+
+/* A request has been answered with verdict, one of STATS_* */
+void stats_request(int verdict) {
+    ctr_t *v = stats_local();
+
+    CTR_ADD(v, ST_REQUESTS, 1);
+    CTR_ADD(v, verdict == STATS_REJECT ? ST_REJECT : verdict == STATS_INVALID ? ST_INVALID : ST_DUNNO, 1);
+}
+
+
+/* A request has been answered when its deadline passed */
+void stats_late(void) {
+    COUNT(ST_LATE, 1);
+}
+
+
+/*
+ * Start counting. Must be called before any other thread is started.
+ */
+void stats_start() {
+    start = time(NULL);
+    if (!counters) {
+        counters = ctr_new(ST_SLOTS);
     }
-    return (sum / r->count);
+    return;
 }
 
 
@@ -199,10 +351,19 @@ char *fmt_secs(unsigned int s) {
     return strdup(buf);
 }
 
+
+#define RATIO(a, b)    ((b) ? (float) (a) / (float) (b) : 0.0)
+
+/*
+ * Log the statistics. Called from one thread at a time, the event loop.
+ */
 void stats_log() {
     unsigned int runtime;
     time_t now = time(NULL);
     char *running;
+    ctr_t c[ST_SLOTS];
+    char h[4][64];
+    int i;
 
     runtime = now - start;
     running = fmt_secs(runtime);
@@ -210,12 +371,30 @@ void stats_log() {
         syslog(LOG_NOTICE, "Out of memory in stats_log()");
         return;
     }
+    ctr_sums(counters, 0, ST_SLOTS, c);
+    /* Histograms since the previous report */
+    for (i = ST_H_REQUEST; i < ST_SLOTS; i++) {
+        c[i] -= last[i];
+        last[i] += c[i];
+    }
     syslog(LOG_INFO,
-           "Running for %s; %d requests (%0.1f req/min); %u workers (%d ms avg, %d parallel, %d current); %u solvers (%d ms avg, %d parallel, %d current)",
-           running, requests, (float) requests / ((float) runtime / (float) 60),
-           num_workers, ring_average(&workertime), max_workers, now_workers,
-           num_solvers, ring_average(&solvertime), max_solvers, now_solvers);
+           "Running for %s; %lu requests (%0.1f req/min; %lu rejected, %lu passed, %lu invalid, %lu past deadline); %d workers (%d parallel, %d current); %d DNS sockets (%d max in flight, %d current; %lu lookups, %lu coalesced, %0.1f%%; %lu hedged, %0.1f%% of them answered first); queue %d current, %d max, %lu overloaded; cache %lu hits, %lu misses, %lu evictions; verdicts %lu hits, %lu misses; sessions %lu hits; %lu lookups saved (%0.1f per request); %lu connections closed (%0.1f requests avg, %d max); allocations per request %0.1f heap, %0.1f arena",
+           running, c[ST_REQUESTS], RATIO(c[ST_REQUESTS], runtime / 60.0),
+           c[ST_REJECT], c[ST_DUNNO], c[ST_INVALID], c[ST_LATE],
+           num_workers, max_workers, now_workers, num_solvers, max_solvers, now_solvers,
+           c[ST_LOOKUPS], c[ST_COALESCED], 100.0 * RATIO(c[ST_COALESCED], c[ST_LOOKUPS]),
+           c[ST_HEDGES], 100.0 * RATIO(c[ST_HEDGE_WINS], c[ST_HEDGES]),
+           now_queued, max_queued, c[ST_OVERLOADED],
+           c[ST_CACHE_HITS], c[ST_CACHE_MISSES], c[ST_CACHE_EVICTIONS],
+           c[ST_VERDICT_HITS], c[ST_VERDICT_MISSES], c[ST_SESSION_HITS],
+           c[ST_SAVED], RATIO(c[ST_SAVED], c[ST_PLANNED]),
+           c[ST_CONNECTIONS], RATIO(c[ST_CONN_REQUESTS], c[ST_CONNECTIONS]), max_conn_requests,
+           RATIO(c[ST_ALLOC_HEAP], c[ST_ALLOC_REQUESTS]), RATIO(c[ST_ALLOC_ARENA], c[ST_ALLOC_REQUESTS]));
+    syslog(LOG_INFO, "Latency ms p50/p95/p99/max: request %s; queue wait %s; DNS wait %s; DNS answer %s",
+           hist_format(h[0], sizeof(h[0]), c + ST_H_REQUEST), hist_format(h[1], sizeof(h[1]), c + ST_H_QUEUEWAIT),
+           hist_format(h[2], sizeof(h[2]), c + ST_H_SOLVERWAIT), hist_format(h[3], sizeof(h[3]), c + ST_H_SOLVER));
     free(running);
+    dns_log_stats();
+    cfg_log_stats();
     return;
 }
-
@@ -30,14 +30,57 @@
 #include "config.h"
 #endif
 
+/* Verdicts for stats_request() */
+#define STATS_DUNNO      0
+#define STATS_REJECT     1
+#define STATS_INVALID    2
+
 extern void stats_worker_thr(int num);
 
-extern void stats_worker_time(struct timeval *start, struct timeval *end);
+extern void stats_clock(struct timeval *tv);
+
+extern void stats_request_time(struct timeval *start, struct timeval *end);
 
 extern void stats_solver_thr(int num);
 
 extern void stats_solver_time(struct timeval *start, struct timeval *end);
 
+extern void stats_solver_wait(struct timeval *start, struct timeval *end);
+
+extern void stats_solver_lookup(int coalesced);
+
+extern void stats_solver_hedge(int won);
+
+extern void stats_solver_inflight(int num);
+
+extern void stats_queue_depth(int depth);
+
+extern void stats_queue_wait(struct timeval *start, struct timeval *end);
+
+extern void stats_overload(void);
+
+extern void stats_cache_hit(void);
+
+extern void stats_cache_miss(void);
+
+extern void stats_cache_evict(void);
+
+extern void stats_verdict_hit(void);
+
+extern void stats_verdict_miss(void);
+
+extern void stats_planner(int saved);
+
+extern void stats_connection(int requests);
+
+extern void stats_session_hit(void);
+
+extern void stats_allocs(unsigned long heap, unsigned long arena);
+
+extern void stats_request(int verdict);
+
+extern void stats_late(void);
+
 extern void stats_start(void);
 
 extern void stats_log(void);
@@ -48,10 +48,14 @@
 #endif
 
 #include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
 
 #include "system.h"
 
 #include "cfgfile.h"
+#include "request.h"
+#include "evloop.h"
 #include "thrmgr.h"
 #include "worker.h"
 #include "stats.h"
@@ -59,10 +63,7 @@
 
 
 static thrmgr_t *workermgr = NULL;
-static thrmgr_t *solvermgr = NULL;
 
-static pthread_mutex_t worker_init_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t solver_init_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * A new thread has been created, update manager struct.
@@ -134,136 +135,243 @@ int thr_unregister(thrmgr_t *mgr, pthread_t tid) {
 
 
 /*
- * Wait for all worker threads to finish in order to reload the config file.
- * Returns number of threads still alive after some time
+ * Bounded request queue shared by the worker pool.
+ * This is a lock-free multi-producer/multi-consumer ring buffer: every cell
+ * carries a sequence number telling whether it is free for the producer at
+ * position seq, or filled for the consumer at position seq - 1.
+ * Idle workers sleep on the 'items' semaphore.
  */
-int thr_waitcomplete(void) {
-    struct timespec ts;
-    ts.tv_sec = 0;
-    ts.tv_nsec = 250000;    /* 250 ms */
-    int err;
-
-    if (!workermgr) {
-        syslog(LOG_NOTICE, "thr_waitcomplete() called with uninitialized workermgr");
-        exit(255);
+typedef struct {
+    volatile unsigned int seq;
+    conn_t *conn;
+    struct timeval queued;
+} connq_cell_t;
+
+typedef struct {
+    connq_cell_t *cells;
+    unsigned int mask;
+    volatile unsigned int head;    /* next enqueue position */
+    char pad[60];                  /* keep producer and consumer apart */
+    volatile unsigned int tail;    /* next dequeue position */
+    sem_t items;
+} connq_t;
+
+static connq_t connq;
+static pthread_t *wpool = NULL;
+static int wpool_size = 0;
+static volatile int wpool_busy = 0;
+
+
+static int connq_init(int depth) {
+    unsigned int size = 1;
+    unsigned int i;
+
+    while (size < (unsigned int) depth) {
+        size <<= 1;
     }
-    dbg("Waiting for worker threads to finish");
-    /* Wait 10 seconds for all worker threads to disappear */
-    for (err = 400; err > 0 && workermgr->nthreads && appstate != APP_EXIT; --err) {
-        dbg("Still %d worker threads busy", workermgr->nthreads);
-        nanosleep(&ts, NULL);
+    memset(&connq, 0, sizeof(connq));
+    if ((connq.cells = calloc(size, sizeof(connq_cell_t))) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < size; i++) {
+        connq.cells[i].seq = i;
     }
-    return err;
+    connq.mask = size - 1;
+    if (sem_init(&connq.items, 0, 0) != 0) {
+        free(connq.cells);
+        connq.cells = NULL;
+        return -1;
+    }
+    return 0;
 }
 
 
-/*
- * Create a new worker thread for connection conn
- */
-int wthread_create(int conn) {
-    struct timespec ts;
-    ts.tv_sec = 0;
-    ts.tv_nsec = 100000;    /* 100 ms */
-    pthread_t tid;
-    int err;
-    pthread_attr_t attr;
-    char errbuf[1024];
+static int connq_push(conn_t *conn) {
+    connq_cell_t *cell;
+    unsigned int pos, seq;
+    int dif;
 
-    pthread_mutex_lock(&worker_init_mutex);
-    if (!workermgr) {
-        workermgr = malloc(sizeof(thrmgr_t));
-        pthread_mutex_init(&workermgr->lock, NULL);
-        memset(workermgr, 0, sizeof(thrmgr_t));
-        strcpy(workermgr->name, "worker");
-        workermgr->nthreads = 0;
+    pos = __atomic_load_n(&connq.head, __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &connq.cells[pos & connq.mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        dif = (int) (seq - pos);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&connq.head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return -1;    /* full */
+        } else {
+            pos = __atomic_load_n(&connq.head, __ATOMIC_RELAXED);
+        }
     }
-    pthread_mutex_unlock(&worker_init_mutex);
+    cell->conn = conn;
+    stats_clock(&cell->queued);
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    sem_post(&connq.items);
+    return 0;
+}
 
-    pthread_mutex_lock(&workermgr->lock);
-    /* Try 20 times (2 seconds) until a thread becomes available */
-    for (err = 20; err > 0 && workermgr->nthreads >= maxthreads && appstate == APP_RUN; --err) {
-        nanosleep(&ts, NULL);
-    }
-    if (appstate != APP_RUN) {
-        /* Daemon is in shutdown or reload mode, do not allow new threads */
-        pthread_mutex_unlock(&workermgr->lock);
-        return -ERR_THR_APPSTATE;
-    }
-    if (err <= 0) {
-        /* Timeout waiting for free thread */
-        pthread_mutex_unlock(&workermgr->lock);
-        return -ERR_THR_TOOMANY;
-    }
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    if ((err = pthread_create(&tid, &attr, worker_th, (void *) conn)) != 0) {
-        strerror_r(errno, errbuf, 1024);
-        syslog(LOG_NOTICE, "Failed to create new thread: %s", errbuf);
-        pthread_mutex_unlock(&workermgr->lock);
-        return -ERR_THR_SYSERR;
-    }
-    if (thr_register(workermgr, tid) != 0) {
-        pthread_cancel(tid);
-        close(conn);
-        pthread_mutex_unlock(&workermgr->lock);
-        return -ERR_THR_SYSERR;
+
+static int connq_pop(conn_t **conn, struct timeval *queued) {
+    connq_cell_t *cell;
+    unsigned int pos, seq;
+    int dif;
+
+    pos = __atomic_load_n(&connq.tail, __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &connq.cells[pos & connq.mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        dif = (int) (seq - (pos + 1));
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&connq.tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return -1;    /* empty */
+        } else {
+            pos = __atomic_load_n(&connq.tail, __ATOMIC_RELAXED);
+        }
     }
-    pthread_mutex_unlock(&workermgr->lock);
-    stats_worker_thr(workermgr->nthreads);
+    *conn = cell->conn;
+    *queued = cell->queued;
+    __atomic_store_n(&cell->seq, pos + connq.mask + 1, __ATOMIC_RELEASE);
     return 0;
 }
 
 
-void wthread_exit(pthread_t tid) {
-    if (!workermgr) {
-        syslog(LOG_NOTICE, "wthread_exit() called with uninitialized workermgr");
-        exit(255);
+/*
+ * Number of requests waiting for a worker
+ */
+int wpool_depth(void) {
+    int depth;
+
+    depth = (int) (__atomic_load_n(&connq.head, __ATOMIC_RELAXED) - __atomic_load_n(&connq.tail, __ATOMIC_RELAXED));
+    return depth < 0 ? 0 : depth;
+}
+
+
+/*
+ * Worker pool thread: take requests off the queue until shutdown
+ */
+static void *wpool_th(void *data) {
+    conn_t *conn;
+    struct timeval queued, now;
+
+    while (1) {
+        if (sem_wait(&connq.items) != 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "sem_wait(): %s", strerror(errno));
+            break;
+        }
+        if (connq_pop(&conn, &queued) != 0) {
+            /* Woken up without work: shutdown */
+            if (appstate == APP_EXIT || appstate == APP_ERROR) {
+                break;
+            }
+            continue;
+        }
+        stats_clock(&now);
+        stats_queue_wait(&queued, &now);
+        stats_queue_depth(wpool_depth());
+        __atomic_add_fetch(&wpool_busy, 1, __ATOMIC_RELAXED);
+        worker_th(conn);
+        __atomic_sub_fetch(&wpool_busy, 1, __ATOMIC_RELAXED);
     }
-    thr_unregister(workermgr, tid);
+    return NULL;
 }
 
 
 /*
- * Create a new resolver thread
+ * Start nthreads long-lived worker threads fed by a queue of qdepth
+ * requests.
  */
-int rthread_create(void *data) {
-    pthread_t tid;
-    int err;
-    pthread_attr_t attr;
+int wpool_init(int nthreads, int qdepth) {
+    int i, err;
     char errbuf[1024];
 
-    pthread_mutex_lock(&solver_init_mutex);
-    if (!solvermgr) {
-        solvermgr = malloc(sizeof(thrmgr_t));
-        pthread_mutex_init(&solvermgr->lock, NULL);
-        memset(solvermgr, 0, sizeof(thrmgr_t));
-        strcpy(solvermgr->name, "solver");
-        solvermgr->nthreads = 0;
+    if (qdepth < 1) {
+        qdepth = 1;
     }
-    pthread_mutex_unlock(&solver_init_mutex);
-
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    pthread_mutex_lock(&solvermgr->lock);
-    if ((err = pthread_create(&tid, &attr, solver_th, data)) != 0) {
-        strerror_r(errno, errbuf, 1024);
-        syslog(LOG_NOTICE, "Failed to create solver thread: %s", errbuf);
-        pthread_mutex_unlock(&solvermgr->lock);
+    if (connq_init(qdepth) != 0) {
+        syslog(LOG_ERR, "Failed to allocate request queue of %d entries", qdepth);
         return -ERR_THR_SYSERR;
     }
-    if (thr_register(solvermgr, tid) != 0) {
-        pthread_cancel(tid);
-        pthread_mutex_unlock(&solvermgr->lock);
+    if ((wpool = calloc(nthreads, sizeof(pthread_t))) == NULL) {
+        syslog(LOG_ERR, "Failed to allocate worker pool of %d threads", nthreads);
+        return -ERR_THR_SYSERR;
+    }
+
+    workermgr = malloc(sizeof(thrmgr_t));
+    memset(workermgr, 0, sizeof(thrmgr_t));
+    pthread_mutex_init(&workermgr->lock, NULL);
+    strcpy(workermgr->name, "worker");
+
+    pthread_mutex_lock(&workermgr->lock);
+    for (i = 0; i < nthreads; i++) {
+        if ((err = pthread_create(&wpool[i], NULL, wpool_th, NULL)) != 0) {
+            strerror_r(err, errbuf, 1024);
+            syslog(LOG_ERR, "Failed to create worker thread: %s", errbuf);
+            break;
+        }
+        thr_register(workermgr, wpool[i]);
+    }
+    wpool_size = i;
+    pthread_mutex_unlock(&workermgr->lock);
+    if (wpool_size == 0) {
         return -ERR_THR_SYSERR;
     }
-    stats_solver_thr(solvermgr->nthreads);
-    pthread_mutex_unlock(&solvermgr->lock);
+    stats_worker_thr(wpool_size);
+    dbg("Started %d worker threads, queue depth %u", wpool_size, connq.mask + 1);
     return 0;
 }
 
 
-void rthread_exit(pthread_t tid) {
-    thr_unregister(solvermgr, tid);
+/*
+ * Wake up and join all worker threads. appstate must already be
+ * APP_EXIT or APP_ERROR.
+ */
+void wpool_shutdown(void) {
+    int i;
+
+    if (!wpool) {
+        return;
+    }
+    for (i = 0; i < wpool_size; i++) {
+        sem_post(&connq.items);
+    }
+    for (i = 0; i < wpool_size; i++) {
+        pthread_join(wpool[i], NULL);
+        thr_unregister(workermgr, wpool[i]);
+    }
+    pthread_mutex_destroy(&workermgr->lock);
+    free(workermgr);
+    workermgr = NULL;
+    free(wpool);
+    wpool = NULL;
+    wpool_size = 0;
+    sem_destroy(&connq.items);
+    free(connq.cells);
+    connq.cells = NULL;
+}
+
+
+/*
+ * Hand a complete request to the worker pool. If the queue is full,
+ * -ERR_THR_QFULL is returned and the caller applies the overload policy.
+ */
+int wpool_submit(conn_t *conn) {
+    if (appstate != APP_RUN) {
+        return -ERR_THR_APPSTATE;
+    }
+    if (connq_push(conn) != 0) {
+        return -ERR_THR_QFULL;
+    }
+    stats_queue_depth(wpool_depth());
+    return 0;
 }
 
 
@@ -277,6 +385,8 @@ const char *thr_error(thmgr_err err) {
             return "Fatal OS error";
         case ERR_THR_APPSTATE:
             return "Daemon is shutting down or reloading";
+        case ERR_THR_QFULL:
+            return "Connection queue is full";
     }
     return "";
 }
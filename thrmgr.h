@@ -34,7 +34,8 @@ typedef enum {
     ERR_NONE = 0,
     ERR_THR_TOOMANY,
     ERR_THR_SYSERR,
-    ERR_THR_APPSTATE
+    ERR_THR_APPSTATE,
+    ERR_THR_QFULL
 } thmgr_err;
 
 
@@ -55,19 +56,20 @@ typedef struct thrmgr {
 } thrmgr_t;
 
 
+struct conn;
+
 int thr_register(thrmgr_t *mgr, pthread_t tid);
 
 int thr_unregister(thrmgr_t *mgr, pthread_t tid);
 
-int thr_waitcomplete(void);
+int wpool_init(int nthreads, int qdepth);
 
-int wthread_create(int conn);
+void wpool_shutdown(void);
 
-void wthread_exit(pthread_t tid);
+int wpool_submit(struct conn *conn);
 
-int rthread_create(void *data);
+int wpool_depth(void);
 
-void rthread_exit(pthread_t tid);
 
 const char *thr_error(thmgr_err err);
 
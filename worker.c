@@ -3,7 +3,7 @@
    which allows combining different RBLs with weights.
 
    $Id$
-   RBL lookups and thread management
+   Request handling and RBL lookups
    
    Copyright (C) 2004 Thomas Lamy
 
@@ -48,310 +48,566 @@
 #endif
 
 #include <pthread.h>
+#include <stdint.h>
 
 #include "system.h"
 
 #include "cfgfile.h"
+#include "dns.h"
+#include "cache.h"
+#include "request.h"
+#include "evloop.h"
+#include "session.h"
+#include "counters.h"
+#include "reload.h"
+#include "health.h"
 #include "thrmgr.h"
 #include "worker.h"
 #include "stats.h"
 #include "globals.h"
 #include "xmalloc.h"
 
-static char *read_request(int sock);
+static void solver_done(void *data, const dnsresult_t *res);
 
-static char *parse_request(char *const req);
+static evalctx_t *eval_new(cfgset_t *cfg, unsigned int ip, const char *client);
 
+static void eval_finish(evalctx_t *ctx);
 
-#define CHUNK    1024
+static short *plan_zones(arena_t *arena, evalctx_t *ctx);
 
-static char *read_request(int sock) {
-    char *buf = NULL;
-    fd_set fds;
-    int bufsize = 0;
-    int bread = 0;
-    struct timeval tv;
-    int ret;
+static void eval_wave(evalctx_t *ctx, short *plan, int *next, int planned);
 
-    FD_ZERO(&fds);
-    FD_SET(sock, &fds);
+static int eval_wait(evalctx_t *ctx, const struct timespec *until);
 
-    tv.tv_sec = 10;
-    tv.tv_usec = 0;
+static int eval_verdict(evalctx_t *ctx, arena_t *arena, char **reply, int *replen);
 
-    while (1) {
-        ret = select(sock + 1, &fds, NULL, NULL, &tv);
-        if (ret < 0) {
-            syslog(LOG_NOTICE, "select(): %s", strerror(errno));
-            if (buf) {
-                free(buf);
-            }
-            return NULL;
-        } else if (ret == 0) {
-            // syslog(LOG_NOTICE, "Timeout reading request (%d bytes read so far)", bread);
-            if (buf && bufsize > bread) {
-                buf[bread] = '\0';
-            }
-            return buf;
-        } else {
-            if (bufsize - bread < CHUNK) {
-                bufsize += CHUNK;
-                buf = realloc(buf, bufsize);
-                if (buf == NULL) {
-                    syslog(LOG_ERR, "Could not realloc receive buffer to %d bytes: %s", bufsize, strerror(errno));
-                    return NULL;
-                }
-            }
-            ret = read(sock, buf + bread, bufsize - bread - 1);
-            if (ret <= 0) {
-                syslog(LOG_NOTICE, "Could not read from socket: %s", strerror(errno));
-                if (buf && bufsize > bread) {
-                    buf[bread] = '\0';
-                }
-                return buf;
-            }
-            bread += ret;
-            buf[bread] = '\0';
-            if (strcmp(buf + bread - 4, "\r\n\r\n") == 0 || strcmp(buf + bread - 2, "\n\n") == 0) {
-                /* two line terminators -> end of request */
-                break;
-            }
-        }
-    }
-    return buf;
-}
 
-static char *parse_request(char *const req) {
-    char *c, *p;
-    char *result;
-    if ((c = strstr(req, "client_address=")) == NULL) {
-        return NULL;
-    }
-    c += 15;    /* skip to first value byte */
-    if ((p = strchr(c, '\r')) == NULL) {
-        p = strchr(c, '\n');
-    }
-    if (!p) {
-        syslog(LOG_NOTICE, "EOL terminator not found in '%s'", c - 15);
-        return NULL;
-    }
-    result = malloc(p - c + 1);
-    if (!result) {
-        syslog(LOG_NOTICE, "Could not allocate %d bytes for client address", p - c + 1);
-        return NULL;
+static char *reply_add(arena_t *arena, char *reply, int *replen, const char *rbldomain);
+
+
+/* The verdict can't change any more: rejected, or the zones still
+ * unanswered can't lift the score to 100 */
+#define EVAL_DECIDED(ctx)    ((ctx)->score >= 100 || (ctx)->score + (ctx)->reach < 100)
+
+/*
+ * Append rbldomain to the comma separated list of listing zones
+ */
+static char *reply_add(arena_t *arena, char *reply, int *replen, const char *rbldomain) {
+    int old = *replen;
+
+    if (reply) {
+        *replen += 2 + strlen(rbldomain);
+        reply = xarealloc(arena, reply, old, *replen);
+        strcat(reply, ", ");
+    } else {
+        *replen += strlen(rbldomain) + 1;
+        reply = xamalloc(arena, *replen);
+        reply[0] = '\0';
     }
-    memcpy(result, c, p - c);
-    result[p - c] = '\0';
-    return result;
+    strcat(reply, rbldomain);
+    return reply;
 }
 
-typedef struct {
-    int *resolvers;
-    pthread_mutex_t *resolvers_;    /* Mutex for resolver count */
-    pthread_cond_t *res_ready;    /* All resolvers done condition */
-    char *hostname;    /* Hostname to resolve */
-    char *client;        /* Client addr to look up */
-    cfgitem_t *rblitem;    /* Fast lookup to RBL for statistics, used read-only by resolver */
-    unsigned int time;        /* Time needed for resolving */
-    int score;        /* resulting score */
-} resdata_t;
-
 
 void *worker_th(void *data) {
-    char *request = NULL;
-    char *client = NULL;
-    char rqname[1024];
+    conn_t *conn = data;
+    const char *client;
+    const char *instance;
+    const char *state;
+    int early = 0;
     int score = 0;
     int err = 0;
-    char *rdn = NULL;
-    cfgitem_t *rbl;
+    int z;
     char *reply = NULL;
     int replen = 0;
-    int o1 = -1, o2 = -1, o3 = -1, o4 = -1;
-    int conn = (int) data;
-    int resolvers = 0;
-    resdata_t **resdata = NULL;
-    int resdata_cnt = 0;
-    int i;
-    struct timeval begin, end;
-
-    pthread_mutex_t resolvers_ = PTHREAD_MUTEX_INITIALIZER;
-    pthread_cond_t res_ready_cond = PTHREAD_COND_INITIALIZER;
-
-    gettimeofday(&begin, NULL);
-    request = read_request(conn);
-    if (!request) {
-        syslog(LOG_NOTICE, "Error reading request");
+    char *answer;
+    int anslen;
+    evalctx_t *ctx;
+    cfgset_t *cfg;
+    zonetab_t *tab;
+    short *plan;
+    int next;
+    int finish;
+    unsigned int ip = 0;
+    unsigned long long listed = 0;
+    unsigned int ttl = 0;
+    arena_t *scratch;
+    unsigned long heap, arena, heap0, arena0;
+    struct timeval now;
+    struct timespec until;
+    int late = 0;
+
+    xmalloc_counts(&heap0, &arena0);
+    /* The whole request, queue wait included, must be done by then */
+    until.tv_sec = conn->received.tv_sec + deadline / 1000;
+    until.tv_nsec = conn->received.tv_usec * 1000L + (deadline % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+    /* Plan and reply text, recycled when the request is done */
+    scratch = arena_new();
+    /* The zone list stays valid until cfg_leave() */
+    cfg = cfg_enter();
+    /* Attribute values point into conn->buf */
+    client = req_get(&conn->req, conn->buf, "client_address");
+    if (!client) {
+        syslog(LOG_NOTICE, "No client_address in request (%d attributes)", conn->req.nattr);
         err++;
     }
-    if (!err) {
-        client = parse_request(request);
-        if (!client) {
-            syslog(LOG_NOTICE, "Could not parse request '%s'", request);
-            err++;
-        }
+    instance = req_get(&conn->req, conn->buf, "instance");
+    if (speculate && instance && (state = req_get(&conn->req, conn->buf, "protocol_state")) != NULL) {
+        early = strcasecmp(state, "CONNECT") == 0 || strcasecmp(state, "EHLO") == 0
+                || strcasecmp(state, "HELO") == 0;
     }
     if (!err) {
         dbg("Client address: '%s'", client);
-        rdn = malloc(strlen(client) + 1);
-        if (!rdn) {
-            err++;
-        }
-    }
-    if (!err) {
-        rdn[0] = '\0';
-        if (sscanf(client, "%d.%d.%d.%d", &o1, &o2, &o3, &o4) != 4) {
+        if (req_ipv4(client, &ip) != 0) {
             syslog(LOG_NOTICE, "Invalid client address '%s'", client);
             err++;
         }
     }
     if (!err) {
-        sprintf(rdn, "%d.%d.%d.%d", o4, o3, o2, o1);
-        dbg("Reverse client address: '%s'", rdn);
-        pthread_cond_init(&res_ready_cond, NULL);
-        for (rbl = rblist; rbl && score < 100; rbl = rbl->next) {
-            sprintf(rqname, "%s.%s", rdn, rbl->rbldomain);
-            pthread_mutex_lock(&resolvers_);
-            resdata = xrealloc(resdata, (resdata_cnt + 2) * sizeof(resdata_t *));
-            resdata[resdata_cnt + 1] = NULL;
-            resdata[resdata_cnt] = xmalloc(sizeof(resdata_t));
-            memset(resdata[resdata_cnt], 0, sizeof(resdata_t));
-            resdata[resdata_cnt]->resolvers = &resolvers;
-            resdata[resdata_cnt]->resolvers_ = &resolvers_;
-            resdata[resdata_cnt]->res_ready = &res_ready_cond;
-            resdata[resdata_cnt]->hostname = xstrdup(rqname);
-            resdata[resdata_cnt]->client = client;
-            resdata[resdata_cnt]->rblitem = rbl;
-            resdata[resdata_cnt]->time = 0;
-            resdata[resdata_cnt]->score = 0;
-            resolvers++;
-            rthread_create(resdata[resdata_cnt]);
-            pthread_mutex_unlock(&resolvers_);
-            resdata_cnt++;
+        if (instance && session_get(instance, ip, &answer, &anslen, &ctx)) {
+            if (early) {
+                /* Lookups for this session are already under way */
+                if (ctx) {
+                    eval_release(ctx);
+                } else {
+                    free(answer);
+                }
+                goto reply;
+            }
+            if (!ctx) {
+                /* Another recipient of the same mail */
+                dbg("%s: answer of session %s reused", client, instance);
+                goto send;
+            }
+            /* Join the evaluation started earlier in the session */
+            dbg("%s: joining evaluation of session %s", client, instance);
+            pthread_mutex_lock(&ctx->lock);
+            while (ctx->pending && !EVAL_DECIDED(ctx)) {
+                if (eval_wait(ctx, &until) != 0) {
+                    late = 1;
+                    break;
+                }
+            }
+            score = eval_verdict(ctx, scratch, &reply, &replen);
+            pthread_mutex_unlock(&ctx->lock);
+            eval_release(ctx);
+            goto reply;
         }
-        /* Wait for the resolver threads to finish.
-         * Each resolver signals us it's readiness through pthread_cond_signal() */
-        pthread_mutex_lock(&resolvers_);
-        while (resolvers) {
-            // syslog(LOG_DEBUG, "Worker waiting for %d/%d resolvers", resolvers, resdata_cnt);
-            pthread_cond_wait(&res_ready_cond, &resolvers_);
+        if (vcache_get(ip, &listed, &ttl)) {
+            if (early) {
+                goto reply;
+            }
+            /* Seen recently: rebuild the verdict from the listing zones */
+            tab = cfg->zones;
+            for (z = 0; z < tab->nzones; z++) {
+                if (tab->index[z] < VCACHE_MAXZONES && (listed & (1ULL << tab->index[z]))) {
+                    score += tab->weight[z];
+                    reply = reply_add(scratch, reply, &replen, ZONE_NAME(tab, z));
+                }
+            }
+            dbg("%s: cached verdict, score %d, %u seconds left", client, score, ttl);
+            goto reply;
         }
-        pthread_cond_destroy(&res_ready_cond);
-        // syslog(LOG_DEBUG, "Worker: All resolvers ready");
-
-        score = 0;
-        for (i = 0; i < resdata_cnt; i++) {
-            /* TODO: add timing stats for each rbl */
-            pthread_mutex_lock(&rblist_mutex);
-            resdata[i]->rblitem->questions++;
-            if (resdata[i]->score) {
-                resdata[i]->rblitem->positive++;
-                score += resdata[i]->score;
-                if (reply) {
-                    replen += 2 + strlen(resdata[i]->rblitem->rbldomain);
-                    reply = realloc(reply, replen);
-                    strcat(reply, ", ");
-                } else {
-                    replen += strlen(resdata[i]->rblitem->rbldomain) + 1;
-                    reply = malloc(replen);
-                    reply[0] = '\0';
+        ctx = eval_new(cfg, ip, client);
+        plan = plan_zones(scratch, ctx);
+        next = 0;
+        if (early) {
+            /* Ask all zones at once and leave the evaluation to the
+             * session, a later request joins it */
+            eval_wave(ctx, plan, &next, 0);
+            session_put_eval(instance, ip, ctx);
+            dbg("%s: lookups started early for session %s", client, instance);
+            pthread_mutex_lock(&ctx->lock);
+            finish = (--ctx->pending == 0);
+            pthread_mutex_unlock(&ctx->lock);
+            if (finish) {
+                eval_finish(ctx);
+            }
+            eval_release(ctx);
+            goto reply;
+        }
+        pthread_mutex_lock(&ctx->lock);
+        while (!EVAL_DECIDED(ctx)) {
+            if (ctx->pending == 1) {
+                /* Nothing in flight: start the next wave, if any */
+                if (next >= ctx->maxres) {
+                    break;
                 }
-                strcat(reply, resdata[i]->rblitem->rbldomain);
+                pthread_mutex_unlock(&ctx->lock);
+                eval_wave(ctx, plan, &next, planner);
+                pthread_mutex_lock(&ctx->lock);
+                continue;
             }
-            pthread_mutex_unlock(&rblist_mutex);
-            if (resdata[i]->hostname) {
-                free(resdata[i]->hostname);
+            if (eval_wait(ctx, &until) != 0) {
+                late = 1;
+                break;
             }
-            free(resdata[i]);
         }
-        free(resdata);
-        resdata = NULL;
+        /* Lookups still running after this point only fill the cache */
+        finish = (--ctx->pending == 0);
+        score = eval_verdict(ctx, scratch, &reply, &replen);
+        dbg("%s: %d of %d zones asked", client, ctx->nres, ctx->maxres);
+        stats_planner(ctx->maxres - ctx->nres);
+        pthread_mutex_unlock(&ctx->lock);
+        if (finish) {
+            eval_finish(ctx);
+        }
+        eval_release(ctx);
     } /* endif(!err) */
-    if (!err) {
+    reply:
+    if (late) {
+        /* Out of time: answer with what we have, the lookups still
+         * running fill the cache for the next request */
+        syslog(LOG_INFO, "%s: deadline of %d ms reached", client, deadline);
+        stats_late();
+    }
+    if (!err && !early) {
         syslog(LOG_INFO, "%s: score %d", client, score);
     }
-    if (!err && score >= 100) {
+    /* Early in the session the verdict is kept for a later request */
+    if (!err && !early && score >= 100) {
         dbg("Reply: 'action=REJECT Blocked through %s'", reply);
-        write(conn, "action=REJECT Blocked through ", 30);
-        write(conn, reply, strlen(reply));
-        // write(conn, "\r\n\r\n", 4);
-        write(conn, "\n\n", 2);
+        answer = xmalloc(replen + 33);
+        anslen = sprintf(answer, "action=REJECT Blocked through %s\n\n", reply);
     } else {
         dbg("Reply: 'action=DUNNO'");
-        write(conn, "action=DUNNO", 12);
-        // write(conn, "\r\n\r\n", 4);
-        write(conn, "\n\n", 2);
+        answer = xstrdup("action=DUNNO\n\n");
+        anslen = 14;
     }
-    if (request) {
-        free(request);
+    if (!err && !early && instance) {
+        session_put(instance, ip, answer, anslen);
     }
-    if (client) {
-        free(client);
+    send:
+    stats_request(err ? STATS_INVALID : strncmp(answer, "action=REJECT", 13) == 0 ? STATS_REJECT : STATS_DUNNO);
+    stats_clock(&now);
+    stats_request_time(&conn->received, &now);
+    /* The event loop sends it and owns conn from here on; this
+     * includes the buffer client and instance point into */
+    ev_reply(conn, answer, anslen);
+    arena_free(scratch);
+    cfg_leave();
+    xmalloc_counts(&heap, &arena);
+    stats_allocs(heap - heap0, arena - arena0);
+    return NULL;
+}
+
+
+/*
+ * New evaluation against the zones of cfg, which it keeps a reference
+ * to: lookups may outlive the request, and a reload with it
+ */
+static evalctx_t *eval_new(cfgset_t *cfg, unsigned int ip, const char *client) {
+    pthread_condattr_t attr;
+    evalctx_t *ctx;
+    arena_t *arena;
+    int z;
+
+    /* The context lives in its own arena, it may outlast the request */
+    arena = arena_new();
+    ctx = xamalloc(arena, sizeof(evalctx_t));
+    memset(ctx, 0, sizeof(evalctx_t));
+    ctx->arena = arena;
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ctx->ready, &attr);
+    pthread_condattr_destroy(&attr);
+    ctx->refs = 1;
+    ctx->pending = 1;
+    ctx->ip = ip;
+    strncpy(ctx->client, client, sizeof(ctx->client) - 1);
+    ctx->cfg = cfg;
+    cfg_hold(cfg);
+    ctx->maxres = cfg->zones->nzones;
+    for (z = 0; z < ctx->maxres; z++) {
+        ctx->reach += cfg->zones->weight[z];
     }
-    if (rdn) {
-        free(rdn);
+    ctx->res = xamalloc(arena, (ctx->maxres ? ctx->maxres : 1) * sizeof(resdata_t));
+    memset(ctx->res, 0, (ctx->maxres ? ctx->maxres : 1) * sizeof(resdata_t));
+    return ctx;
+}
+
+
+/*
+ * Called once all lookups of an evaluation are done, whether or not the
+ * worker is still waiting: update the zone statistics and cache the verdict.
+ */
+static void eval_finish(evalctx_t *ctx) {
+    zonetab_t *tab = ctx->cfg->zones;
+    int n = tab->nzones;
+    ctr_t *v;
+    resdata_t *r;
+    unsigned long long listed = 0;
+    unsigned int ttl = 0;
+    /* Zones skipped by the planner don't matter once the verdict is final */
+    int cacheable = ctx->nres == ctx->maxres || EVAL_DECIDED(ctx);
+    int i;
+
+    /* This thread's counters, no lock needed */
+    v = ctr_local(ctx->cfg->stats);
+    for (i = 0; i < ctx->nres; i++) {
+        r = &ctx->res[i];
+        CTR_ADD(v, ZS_QUESTIONS(n, r->zone), 1);
+        if (r->score) {
+            CTR_ADD(v, ZS_POSITIVE(n, r->zone), 1);
+        }
+        /* The verdict lives as long as its shortest lived answer */
+        if (!r->done || tab->index[r->zone] >= VCACHE_MAXZONES) {
+            cacheable = 0;
+        } else {
+            if (r->score) {
+                listed |= 1ULL << tab->index[r->zone];
+            }
+            if (i == 0 || r->ttl < ttl) {
+                ttl = r->ttl;
+            }
+        }
     }
-    if (reply) {
-        free(reply);
+    /* Verdicts must not mix zone lists across a reload */
+    if (cacheable && ctx->nres && !cfg_stale(ctx->cfg)) {
+        vcache_put(ctx->ip, listed, ttl);
     }
-    close(conn);
-    gettimeofday(&end, NULL);
-    stats_worker_time(&begin, &end);
-    wthread_exit(pthread_self());
-    return NULL;
 }
 
 
-void *solver_th(void *data) {
-    resdata_t *r = data;
-    struct hostent hostbuf, *hp;
-    size_t hstbuflen;
-    char *tmphstbuf;
-    int res;
-    int herr;
-    char result[128];
-    struct timeval begin, end;
-    struct timeval res_begin, res_end;
-
-    gettimeofday(&begin, NULL);
-    // syslog(LOG_DEBUG, "(%ld) Lookup '%s'", pthread_self(), r->hostname);
-
-    hstbuflen = 1024;
-    /* Allocate buffer, remember to free it to avoid memory leakage.  */
-    tmphstbuf = malloc(hstbuflen);
-
-    gettimeofday(&res_begin, NULL);
-    while ((res = gethostbyname_r(r->hostname, &hostbuf, tmphstbuf, hstbuflen, &hp, &herr)) == ERANGE) {
-        /* Enlarge the buffer.  */
-        hstbuflen *= 2;
-        tmphstbuf = realloc(tmphstbuf, hstbuflen);
+
+/*
+ * Order in which to ask the zones. Without the planner that's the order
+ * of the config file. With it, zones that are likely to decide the
+ * verdict cheaply go first: heavy zones with a good hit rate and a
+ * low average answer time.
+ */
+static short *plan_zones(arena_t *arena, evalctx_t *ctx) {
+    cfgset_t *cfg = ctx->cfg;
+    int nzones = ctx->maxres;
+    short *plan;
+    double *key;
+    double k, hits;
+    int i, j;
+
+    plan = xamalloc(arena, (nzones ? nzones : 1) * sizeof(short));
+    for (i = 0; i < nzones; i++) {
+        plan[i] = i;
     }
-    gettimeofday(&res_end, NULL);
-    if (hp) {
-        if (hp->h_addrtype == AF_INET) {
-            char **addrlist = hp->h_addr_list;
-            for (; *addrlist != NULL; addrlist++) {
-                inet_ntop(AF_INET, *addrlist, result, 127);
-                dbg("'%s' = %s", r->hostname, result);
-                if (strncmp(result, "127.", 4) == 0) {
-                    dbg("%s found in %s", r->client, r->rblitem->rbldomain);
-                    r->score = r->rblitem->weight;
-                    break;
-                } /* endif (127.0.0.x) */
-            } /* end foreach(host) */
-        } /* endif AF_INET */
-    } /* endif h */
-
-    free(tmphstbuf);
-    /* Done, signal the worker thread */
-    pthread_mutex_lock(r->resolvers_);
-    *r->resolvers = *r->resolvers - 1;
-    // syslog(LOG_DEBUG, "(%ld) Resolver for '%s' done, %d resolvers left", pthread_self(), r->hostname, *r->resolvers);
-    pthread_cond_broadcast(r->res_ready);
-    pthread_mutex_unlock(r->resolvers_);
-    gettimeofday(&end, NULL);
-    stats_solver_time(&begin, &end);
-    rthread_exit(pthread_self());
-    return NULL;
+    /* Zone timeouts are refreshed here too */
+    cfg_rates(cfg);
+    if (!planner) {
+        return plan;
+    }
+    key = xamalloc(arena, (nzones ? nzones : 1) * sizeof(double));
+    for (i = 0; i < nzones; i++) {
+        /* Smoothed hit rate, so new zones start at 1/2 */
+        hits = __atomic_load_n(&cfg->hitrate[i], __ATOMIC_RELAXED) / 65536.0;
+        k = cfg->zones->weight[i] * (1.0 + hits) / (__atomic_load_n(&cfg->rtt[i], __ATOMIC_RELAXED) + 10.0);
+        /* Insertion sort, zone lists are short */
+        for (j = i; j > 0 && key[j - 1] < k; j--) {
+            plan[j] = plan[j - 1];
+            key[j] = key[j - 1];
+        }
+        plan[j] = i;
+        key[j] = k;
+    }
+    return plan;
+}
+
+
+/*
+ * Start the next wave of lookups in plan order. A planned wave ends as
+ * soon as its answers could decide the verdict either way; otherwise it
+ * covers all remaining zones. Cached answers are taken right away.
+ */
+static void eval_wave(evalctx_t *ctx, short *plan, int *next, int planned) {
+    zonetab_t *tab = ctx->cfg->zones;
+    unsigned char qname[DNS_MAXNAME];
+    int qlen;
+    cacheres_t cres;
+    resdata_t *r;
+    int z, weight, hedge;
+    int score, reach;
+    int wave = 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    score = ctx->score;
+    reach = ctx->reach;
+    pthread_mutex_unlock(&ctx->lock);
+    while (*next < ctx->maxres) {
+        if (score >= 100 || score + reach < 100) {
+            break;
+        }
+        if (planned && wave && (score + wave >= 100 || score + reach - wave < 100)) {
+            break;
+        }
+        z = plan[(*next)++];
+        weight = tab->weight[z];
+        if (!ZONE_USABLE(ctx->cfg, z)) {
+            /* Circuit open: the zone doesn't count, like a failed lookup */
+            CTR_ADD(ctr_local(ctx->cfg->stats), ZS_SKIPPED(tab->nzones, z), 1);
+            pthread_mutex_lock(&ctx->lock);
+            ctx->reach -= weight;
+            pthread_mutex_unlock(&ctx->lock);
+            reach -= weight;
+            continue;
+        }
+        r = &ctx->res[ctx->nres];
+        r->ctx = ctx;
+        r->zone = z;
+        if (cache_get(ctx->ip, tab->index[z], &cres)) {
+            dbg("%s in %s cached: %s", ctx->client, ZONE_NAME(tab, z), cres.listed ? "listed" : "not listed");
+            pthread_mutex_lock(&ctx->lock);
+            ctx->nres++;
+            if (cres.listed) {
+                r->score = weight;
+                ctx->score += r->score;
+            }
+            ctx->reach -= weight;
+            r->ttl = cres.ttl;
+            r->done = 1;
+            pthread_mutex_unlock(&ctx->lock);
+            score += r->score;
+            reach -= weight;
+            continue;
+        }
+        /* Never hold ctx->lock while submitting, dns_query() may block */
+        pthread_mutex_lock(&ctx->lock);
+        ctx->nres++;
+        ctx->pending++;
+        ctx->refs++;
+        pthread_mutex_unlock(&ctx->lock);
+        /* Reversed octets and the zone's wire suffix, built on the stack */
+        qlen = dns_rblname(qname, ctx->ip, ZONE_QSUFFIX(tab, z), tab->qsuffixlen[z]);
+        /* Only the heavy zones are worth a second query */
+        hedge = hedgeweight && weight >= hedgeweight ? __atomic_load_n(&ctx->cfg->hedge[z], __ATOMIC_RELAXED) : 0;
+        if (qlen < 0 || dns_query_wire(qname, qlen, __atomic_load_n(&ctx->cfg->tmo[z], __ATOMIC_RELAXED), hedge, solver_done, r) != 0) {
+            pthread_mutex_lock(&ctx->lock);
+            ctx->pending--;
+            ctx->refs--;
+            ctx->reach -= weight;
+            pthread_mutex_unlock(&ctx->lock);
+            reach -= weight;
+            continue;
+        }
+        wave += weight;
+    }
+}
+
+
+/*
+ * Wait for a lookup of ctx to finish, until the request deadline if
+ * there is one. Returns non-zero once it has passed. Caller must hold
+ * ctx->lock.
+ */
+static int eval_wait(evalctx_t *ctx, const struct timespec *until) {
+    if (deadline <= 0) {
+        pthread_cond_wait(&ctx->ready, &ctx->lock);
+        return 0;
+    }
+    return pthread_cond_timedwait(&ctx->ready, &ctx->lock, until) == ETIMEDOUT;
 }
 
+
+/*
+ * Score so far, and the list of listing zones appended to *reply.
+ * Caller must hold ctx->lock.
+ */
+static int eval_verdict(evalctx_t *ctx, arena_t *arena, char **reply, int *replen) {
+    int i;
+
+    for (i = 0; i < ctx->nres; i++) {
+        if (ctx->res[i].score) {
+            *reply = reply_add(arena, *reply, replen, ZONE_NAME(ctx->cfg->zones, ctx->res[i].zone));
+        }
+    }
+    if (ctx->pending) {
+        dbg("%s: decided with %d lookups outstanding", ctx->client, ctx->pending);
+    }
+    return ctx->score;
+}
+
+
+/*
+ * Take another reference to ctx
+ */
+void eval_hold(evalctx_t *ctx) {
+    pthread_mutex_lock(&ctx->lock);
+    ctx->refs++;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+
+/*
+ * Drop a reference to ctx, freeing it with the last one
+ */
+void eval_release(evalctx_t *ctx) {
+    cfgset_t *cfg = ctx->cfg;
+    int i;
+
+    pthread_mutex_lock(&ctx->lock);
+    i = --ctx->refs;
+    pthread_mutex_unlock(&ctx->lock);
+    if (i) {
+        return;
+    }
+    pthread_cond_destroy(&ctx->ready);
+    pthread_mutex_destroy(&ctx->lock);
+    arena_free(ctx->arena);
+    cfg_release(cfg);
+}
+
+
+/*
+ * DNS completion callback for one RBL lookup. Runs on the DNS event thread.
+ */
+static void solver_done(void *data, const dnsresult_t *res) {
+    resdata_t *r = data;
+    evalctx_t *ctx = r->ctx;
+    zonetab_t *tab = ctx->cfg->zones;
+    ctr_t *v;
+    int finish;
+
+    /* Answer times only, the zone's timeout is derived from them */
+    if (res->status == DNS_LISTED || res->status == DNS_NOTLISTED || res->status == DNS_SERVFAIL) {
+        v = ctr_local(ctx->cfg->stats);
+        HIST_ADD(v, ZS_RTT(tab->nzones, r->zone), res->rtt);
+        if (res->status == DNS_SERVFAIL) {
+            CTR_ADD(v, ZS_SERVFAILS(tab->nzones, r->zone), 1);
+        }
+    } else if (res->status == DNS_TIMEOUT) {
+        CTR_ADD(ctr_local(ctx->cfg->stats), ZS_TIMEOUTS(tab->nzones, r->zone), 1);
+    }
+    if (res->status == DNS_LISTED) {
+        dbg("%s found in %s (127.%d.%d.%d)", ctx->client, ZONE_NAME(tab, r->zone),
+            (res->addr >> 8) & 0xff, (res->addr >> 16) & 0xff, (res->addr >> 24) & 0xff);
+    } else if (res->status != DNS_NOTLISTED) {
+        dbg("Lookup of %s in %s: %s", ctx->client, ZONE_NAME(tab, r->zone), dns_status(res->status));
+    }
+    if (res->status == DNS_LISTED || res->status == DNS_NOTLISTED) {
+        cache_put(ctx->ip, tab->index[r->zone], res->status == DNS_LISTED, res->addr, res->ttl);
+    }
+    pthread_mutex_lock(&ctx->lock);
+    if (res->status == DNS_LISTED) {
+        r->score = tab->weight[r->zone];
+        ctx->score += r->score;
+    }
+    ctx->reach -= tab->weight[r->zone];
+    if (res->status == DNS_LISTED || res->status == DNS_NOTLISTED) {
+        r->ttl = res->ttl;
+        if (r->ttl > (unsigned int) (res->status == DNS_LISTED ? posttl : negttl)) {
+            r->ttl = res->status == DNS_LISTED ? posttl : negttl;
+        }
+        r->done = 1;
+    }
+    finish = (--ctx->pending == 0);
+    /* Wake the worker if the verdict is decided or the wave is done */
+    if (ctx->pending <= 1 || EVAL_DECIDED(ctx)) {
+        pthread_cond_broadcast(&ctx->ready);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    if (finish) {
+        eval_finish(ctx);
+    }
+    eval_release(ctx);
+}
@@ -30,9 +30,44 @@
 #include "config.h"
 #endif
 
+struct evalctx;
+
+/* A single RBL lookup, handed to the DNS engine */
+typedef struct resdata {
+    struct evalctx *ctx;    /* evaluation this lookup belongs to */
+    short zone;            /* zone number in ctx->cfg->zones */
+    int score;        /* resulting score */
+    unsigned int ttl;        /* seconds the answer may be cached */
+    char done;        /* got a definite (listed/not listed) answer */
+} resdata_t;
+
+/*
+ * Evaluation of one client address against all RBLs. Shared between the
+ * worker and its outstanding lookups, freed when the last one lets go;
+ * the worker may reply and leave before all lookups are done.
+ */
+typedef struct evalctx {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;    /* score decided or nothing pending */
+    int refs;            /* worker + lookups in flight */
+    int pending;        /* lookups in flight (+1 while submitting) */
+    int score;            /* sum of weights of listing zones so far */
+    int reach;            /* sum of weights of zones not answered yet */
+    unsigned int ip;        /* Client addr, host byte order */
+    char client[16];        /* Client addr for logging */
+    int nres;            /* used entries in res */
+    int maxres;            /* number of configured zones */
+    resdata_t *res;
+    struct arena *arena;    /* ctx and res live here */
+    struct cfgset *cfg;        /* zone list the evaluation runs against */
+} evalctx_t;
+
 extern void *worker_th(void *);
 
-extern void *solver_th(void *);
+extern void eval_hold(evalctx_t *ctx);
+
+extern void eval_release(evalctx_t *ctx);
+
 
 #endif
 
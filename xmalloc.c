@@ -19,6 +19,8 @@
 # include <config.h>
 #endif
 
+#include <pthread.h>
+
 #include "xmalloc.h"
 #include "error.h"
 
@@ -31,6 +33,10 @@
    The caller may set it to some other value.  */
 int xmalloc_exit_failure = EXIT_FAILURE;
 
+/* Allocations made by this thread, from the heap and from arenas */
+static __thread unsigned long heap_allocs = 0;
+static __thread unsigned long arena_allocs = 0;
+
 static VOID *
 fixup_null_alloc(size_t n) {
     VOID *p;
@@ -49,6 +55,7 @@ VOID *
 xmalloc(size_t n) {
     VOID *p;
 
+    heap_allocs++;
     p = malloc(n);
     if (p == 0)
         p = fixup_null_alloc(n);
@@ -61,6 +68,7 @@ VOID *
 xcalloc(size_t n, size_t s) {
     VOID *p;
 
+    heap_allocs++;
     p = calloc(n, s);
     if (p == 0)
         p = fixup_null_alloc(n);
@@ -75,6 +83,7 @@ VOID *
 xrealloc(VOID *p, size_t n) {
     if (p == 0)
         return xmalloc(n);
+    heap_allocs++;
     p = realloc(p, n);
     if (p == 0)
         p = fixup_null_alloc(n);
@@ -91,3 +100,219 @@ xstrdup(char *str) {
     strcpy(p, str);
     return p;
 }
+
+/* Number of allocations made by the calling thread so far.  */
+
+void
+xmalloc_counts(unsigned long *heap, unsigned long *arena) {
+    *heap = heap_allocs;
+    *arena = arena_allocs;
+}
+
+/* Arenas. The first chunk holds the header and is kept when the arena
+   is recycled; further chunks are only added for requests that don't
+   fit and are freed again with the arena.  */
+
+#define ARENA_ALIGN    16
+
+struct chunk {
+    struct chunk *next;
+    double align;
+};
+
+struct arena {
+    struct arena *next;    /* free list */
+    struct chunk *extra;   /* chunks beyond the first */
+    char *ptr;             /* next free byte */
+    char *end;             /* end of the current chunk */
+    char *last;            /* most recent allocation, may grow in place */
+    double align;
+};
+
+#define ARENA_HDR      ((sizeof(arena_t) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+#define CHUNK_HDR      ((sizeof(struct chunk) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+static __thread arena_t *arena_cache = 0;
+static __thread int arena_ncache = 0;
+
+static arena_t *arena_pool = 0;
+static int arena_npool = 0;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+static void
+arena_reset(arena_t *a) {
+    struct chunk *c;
+
+    while ((c = a->extra) != 0) {
+        a->extra = c->next;
+        free(c);
+    }
+    a->ptr = (char *) a + ARENA_HDR;
+    a->end = (char *) a + ARENA_SIZE;
+    a->last = 0;
+}
+
+/* Move up to n arenas from this thread's cache to the shared pool,
+   freeing those the pool has no room for.  */
+
+static void
+arena_spill(int n) {
+    arena_t *a;
+    arena_t *drop = 0;
+
+    pthread_mutex_lock(&arena_lock);
+    while (n-- > 0 && (a = arena_cache) != 0) {
+        arena_cache = a->next;
+        arena_ncache--;
+        if (arena_npool < ARENA_POOL) {
+            a->next = arena_pool;
+            arena_pool = a;
+            arena_npool++;
+        } else {
+            a->next = drop;
+            drop = a;
+        }
+    }
+    pthread_mutex_unlock(&arena_lock);
+    while ((a = drop) != 0) {
+        drop = a->next;
+        free(a);
+    }
+}
+
+/* Thread exit: hand the cached arenas to the pool.  */
+
+static void
+arena_thread_exit(void *unused) {
+    arena_spill(arena_ncache);
+}
+
+static void
+arena_key_init(void) {
+    pthread_key_create(&arena_key, arena_thread_exit);
+}
+
+/* Get an empty arena: from this thread's cache, a batch from the
+   shared pool, or the heap.  */
+
+arena_t *
+arena_new(void) {
+    arena_t *a;
+    int n;
+
+    if (arena_cache == 0) {
+        pthread_once(&arena_once, arena_key_init);
+        pthread_setspecific(arena_key, &arena_cache);
+        pthread_mutex_lock(&arena_lock);
+        for (n = 0; n < ARENA_BATCH && (a = arena_pool) != 0; n++) {
+            arena_pool = a->next;
+            arena_npool--;
+            a->next = arena_cache;
+            arena_cache = a;
+            arena_ncache++;
+        }
+        pthread_mutex_unlock(&arena_lock);
+    }
+    if ((a = arena_cache) != 0) {
+        arena_cache = a->next;
+        arena_ncache--;
+    } else {
+        a = xmalloc(ARENA_SIZE);
+        a->extra = 0;
+        arena_reset(a);
+    }
+    a->next = 0;
+    return a;
+}
+
+/* Recycle a, along with everything allocated from it. May be called
+   from another thread than the one which got a.  */
+
+void
+arena_free(arena_t *a) {
+    if (a == 0)
+        return;
+    arena_reset(a);
+    pthread_once(&arena_once, arena_key_init);
+    pthread_setspecific(arena_key, &arena_cache);
+    a->next = arena_cache;
+    arena_cache = a;
+    if (++arena_ncache > ARENA_KEEP)
+        arena_spill(ARENA_BATCH);
+}
+
+/* Free the shared pool, once all other threads are gone.  */
+
+void
+arena_shutdown(void) {
+    arena_t *a;
+
+    arena_spill(arena_ncache);
+    pthread_mutex_lock(&arena_lock);
+    while ((a = arena_pool) != 0) {
+        arena_pool = a->next;
+        free(a);
+    }
+    arena_npool = 0;
+    pthread_mutex_unlock(&arena_lock);
+}
+
+/* Allocate N bytes from arena A. There is no way to free them but to
+   free the arena.  */
+
+VOID *
+xamalloc(arena_t *a, size_t n) {
+    struct chunk *c;
+    size_t size;
+
+    arena_allocs++;
+    n = (n + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    if (n == 0)
+        n = ARENA_ALIGN;
+    if ((size_t) (a->end - a->ptr) < n) {
+        size = CHUNK_HDR + n;
+        if (size < ARENA_SIZE)
+            size = ARENA_SIZE;
+        c = xmalloc(size);
+        c->next = a->extra;
+        a->extra = c;
+        a->ptr = (char *) c + CHUNK_HDR;
+        a->end = (char *) c + size;
+    }
+    a->last = a->ptr;
+    a->ptr += n;
+    return a->last;
+}
+
+/* Resize P, which was allocated from A with OLD bytes. The most
+   recent allocation grows in place if there is room.  */
+
+VOID *
+xarealloc(arena_t *a, VOID *p, size_t old, size_t n) {
+    VOID *q;
+    size_t want;
+
+    if (p == 0)
+        return xamalloc(a, n);
+    if (p == a->last) {
+        want = (n + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+        if ((size_t) (a->end - a->last) >= want) {
+            a->ptr = a->last + (want ? want : ARENA_ALIGN);
+            return p;
+        }
+    }
+    q = xamalloc(a, n);
+    memcpy(q, p, old < n ? old : n);
+    return q;
+}
+
+/* Copy STR into arena A.  */
+
+char *
+xastrdup(arena_t *a, const char *str) {
+    size_t n = strlen(str) + 1;
+
+    return memcpy(xamalloc(a, n), str, n);
+}
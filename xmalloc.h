@@ -64,4 +64,21 @@ VOID *xrealloc (VOID *p, size_t n);
 char *xstrdup (char *p);
 #endif
 
+/* Bump allocator for memory that lives exactly as long as a request.
+   Arenas are recycled through a per-thread free list.  */
+#define ARENA_SIZE     4096    /* first chunk, incl. the header */
+#define ARENA_KEEP     16      /* arenas cached per thread */
+#define ARENA_BATCH    8       /* moved to/from the shared pool at once */
+#define ARENA_POOL     1024    /* arenas kept in the shared pool */
+
+typedef struct arena arena_t;
+
+arena_t *arena_new (void);
+void arena_free (arena_t *a);
+void arena_shutdown (void);
+VOID *xamalloc (arena_t *a, size_t n);
+VOID *xarealloc (arena_t *a, VOID *p, size_t old, size_t n);
+char *xastrdup (arena_t *a, const char *str);
+void xmalloc_counts (unsigned long *heap, unsigned long *arena);
+
 